@@ -0,0 +1,507 @@
+//
+//  Benchmark.cpp
+//  Gee-nomics
+//
+//  A standalone benchmark for the hot paths: Genome::load, Trie and KmerTrie insert/find, building a GenomeMatcher
+//  and searching it. It has its own main(), so build it apart from main.cpp:
+//
+//      g++ -std=c++17 -O2 -pthread Benchmark.cpp Genome.cpp GenomeMatcher.cpp -o benchmark
+//      ./benchmark --data ../data --format json --out results.json
+//
+//  Every run uses the same seeded random queries, so results from two builds can be compared directly.
+//  With --verify it instead checks every match kernel the CPU has (see MatchKernel.h) against a plain
+//  base-by-base comparison, and exits with 1 if any of them disagrees.
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include "provided.h"
+#include "Trie.h"
+#include "PackedSequence.h"
+#include "MatchKernel.h"
+using namespace std;
+
+const string DATA_FILES[] = {
+    "Ferroplasma_acidarmanus.txt",
+    "Halobacterium_jilantaiense.txt",
+    "Halorubrum_chaoviator.txt",
+    "Halorubrum_californiense.txt",
+    "Halorientalis_regularis.txt",
+    "Halorientalis_persicus.txt",
+    "Ferroglobus_placidus.txt",
+    "Desulfurococcus_mucosus.txt"
+};
+
+//one measurement: count operations of some unit took seconds
+struct Result
+{
+    string benchmark;
+    string engine;
+    int minSearchLength;
+    string mode;
+    long long count;
+    string unit;
+    double seconds;
+    long long bytes;   //memory the step added, -1 where it doesn't apply
+};
+
+struct Settings
+{
+    string dataDir = "../data";
+    string format = "json";
+    string outFile;
+    long long maxBases = 4000000;   //cap on the library size, 0 for every genome in the data files
+    vector<int> searchLengths = {10, 16, 24};
+    int queries = 20000;
+    int relatedQueries = 3;
+    long long memoryBudget = 0;     //GenomeMatcherOptions::memoryBudget of every matcher built
+    bool verify = false;
+};
+
+class Timer
+{
+public:
+    Timer()
+    : m_start(chrono::steady_clock::now())
+    {
+    }
+    double seconds() const
+    {
+        return chrono::duration<double>(chrono::steady_clock::now()-m_start).count();
+    }
+private:
+    chrono::steady_clock::time_point m_start;
+};
+
+//resident set size of this process in bytes, or -1 where /proc isn't available
+long long residentBytes()
+{
+    ifstream statm("/proc/self/statm");
+    long long pages, resident;
+    if (!(statm >> pages >> resident))
+        return -1;
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+//a length-long piece of a random genome, with one SNiP (never in the first base) when mutate is set
+string sampleFragment(const vector<Genome>& genomes, int length, bool mutate, mt19937& rng)
+{
+    for (;;)
+    {
+        const Genome& g=genomes[rng()%genomes.size()];
+        if (g.length()<length)
+            continue;
+        string fragment;
+        g.extract(rng()%(g.length()-length+1), length, fragment);
+        if (mutate && length>1)
+            fragment[1+rng()%(length-1)]="ACGT"[rng()%4];
+        return fragment;
+    }
+}
+
+void benchmarkLoad(const Settings& settings, vector<Genome>& library, vector<Result>& results)
+{
+    long long bases=0;
+    for (const string& f : DATA_FILES)
+    {
+        ifstream in(settings.dataDir + "/" + f, ios::binary);
+        if (!in)
+            continue;
+        stringstream contents;
+        contents << in.rdbuf();
+        string text=contents.str();
+        //parse from memory so the disk isn't what gets measured
+        vector<Genome> genomes;
+        istringstream source(text);
+        Timer timer;
+        if (!Genome::load(source, genomes))
+        {
+            cerr << "Cannot load " << f << endl;
+            continue;
+        }
+        results.push_back(Result{"Genome::load", "", 0, f, static_cast<long long>(text.size()), "bytes", timer.seconds(), -1});
+        for (size_t k=0;k<genomes.size();k++)
+        {
+            if (settings.maxBases!=0 && bases>=settings.maxBases)
+                break;
+            bases+=genomes[k].length();
+            library.push_back(genomes[k]);
+        }
+    }
+}
+
+//insert up to a million k-mers of the library into a TrieType, then find the queries
+template<typename TrieType>
+void benchmarkTrieType(const string& name, const Settings& settings, const vector<Genome>& library, int k, vector<Result>& results)
+{
+    mt19937 rng(7);
+    long long before=residentBytes();
+    TrieType trie;
+    Timer insertTimer;
+    long long inserted=0;
+    string key;
+    for (size_t g=0;g<library.size() && inserted<1000000;g++)
+    {
+        for (int i=0;library[g].extract(i, k, key) && inserted<1000000;i++,inserted++)
+            trie.insert(key, i);
+    }
+    double insertSeconds=insertTimer.seconds();
+    long long after=residentBytes();
+    results.push_back(Result{name+"::insert", "", k, "", inserted, "keys", insertSeconds, before<0 ? -1 : after-before});
+    for (int exact=1;exact>=0;exact--)
+    {
+        vector<string> keys;
+        for (int q=0;q<settings.queries;q++)
+            keys.push_back(sampleFragment(library, k, !exact, rng));
+        vector<int> found;
+        long long values=0;
+        Timer findTimer;
+        for (size_t q=0;q<keys.size();q++)
+        {
+            found.clear();
+            trie.find(keys[q], exact, found);
+            values+=found.size();
+        }
+        results.push_back(Result{name+"::find", "", k, exact ? "exact" : "snp", static_cast<long long>(keys.size()), "keys", findTimer.seconds(), -1});
+        if (values==0)
+            cerr << name << "::find found nothing for k=" << k << endl;
+    }
+}
+
+//the general Trie, and next to it the KmerTrie for the lengths GenomeMatcher specialises it for
+void benchmarkTrie(const Settings& settings, const vector<Genome>& library, vector<Result>& results)
+{
+    for (int k : settings.searchLengths)
+    {
+        benchmarkTrieType<Trie<int>>("Trie", settings, library, k, results);
+        withKmerTrieDepth(k, [&](auto depth)
+        {
+            benchmarkTrieType<KmerTrie<int, decltype(depth)::value>>("KmerTrie", settings, library, k, results);
+        });
+    }
+}
+
+void benchmarkMatcher(const Settings& settings, const vector<Genome>& library, IndexEngine engine, const string& engineName, vector<Result>& results)
+{
+    mt19937 rng(11);
+    long long bases=0;
+    for (size_t g=0;g<library.size();g++)
+        bases+=library[g].length();
+    for (int k : settings.searchLengths)
+    {
+        GenomeMatcherOptions options;
+        options.engine=engine;
+        options.memoryBudget=settings.memoryBudget;
+        long long before=residentBytes();
+        GenomeMatcher matcher(k, options);
+        Timer buildTimer;
+        for (size_t g=0;g<library.size();g++)
+            matcher.addGenome(library[g]);
+        //an engine may leave work for the first search, count it as part of the build
+        vector<DNAMatch> matches;
+        matcher.findGenomesWithThisDNA(sampleFragment(library, k, false, rng), k, true, matches);
+        double buildSeconds=buildTimer.seconds();
+        long long after=residentBytes();
+        results.push_back(Result{"addGenome", engineName, k, "", bases, "bases", buildSeconds, before<0 ? -1 : after-before});
+        for (int exact=1;exact>=0;exact--)
+        {
+            string mode=exact ? "exact" : "snp";
+            vector<string> fragments;
+            for (int q=0;q<settings.queries;q++)
+                fragments.push_back(sampleFragment(library, k+static_cast<int>(rng()%k), !exact, rng));
+            Timer findTimer;
+            for (size_t q=0;q<fragments.size();q++)
+            {
+                matches.clear();
+                matcher.findGenomesWithThisDNA(fragments[q], k, exact, matches);
+            }
+            results.push_back(Result{"findGenomesWithThisDNA", engineName, k, mode, static_cast<long long>(fragments.size()), "fragments", findTimer.seconds(), -1});
+            vector<vector<DNAMatch>> batchMatches;
+            Timer batchTimer;
+            matcher.findGenomesWithThisDNA(fragments, k, exact, batchMatches);
+            results.push_back(Result{"findGenomesWithThisDNA(batch)", engineName, k, mode, static_cast<long long>(fragments.size()), "fragments", batchTimer.seconds(), -1});
+            //queries cut from the library, so there is something related to find
+            vector<string> queries;
+            long long queried=0;
+            for (int q=0;q<settings.relatedQueries;q++)
+            {
+                queries.push_back(sampleFragment(library, min(100000, library[0].length()), false, rng));
+                queried+=queries.back().size();
+            }
+            Timer relatedTimer;
+            for (size_t q=0;q<queries.size();q++)
+            {
+                vector<GenomeMatch> related;
+                matcher.findRelatedGenomes(Genome("query", queries[q]), 2*k, exact, 10, related);
+            }
+            results.push_back(Result{"findRelatedGenomes", engineName, k, mode, queried, "bases", relatedTimer.seconds(), -1});
+            //the same queries asking only for the best genome, letting the scan drop the rest early
+            RelatedGenomesOptions topOne;
+            topOne.topK=1;
+            topOne.pruneHopeless=true;
+            Timer topTimer;
+            for (size_t q=0;q<queries.size();q++)
+            {
+                vector<GenomeMatch> related;
+                matcher.findRelatedGenomes(Genome("query", queries[q]), 2*k, exact, 10, related, topOne);
+            }
+            results.push_back(Result{"findRelatedGenomes(top1)", engineName, k, mode, queried, "bases", topTimer.seconds(), -1});
+            //and scoring overlapping windows of 2k bases every k/4 bases instead of tiles
+            RelatedGenomesOptions sliding;
+            sliding.stride=max(1, k/4);
+            Timer slidingTimer;
+            for (size_t q=0;q<queries.size();q++)
+            {
+                vector<GenomeMatch> related;
+                matcher.findRelatedGenomes(Genome("query", queries[q]), 2*k, exact, 10, related, sliding);
+            }
+            results.push_back(Result{"findRelatedGenomes(stride)", engineName, k, mode, queried, "bases", slidingTimer.seconds(), -1});
+        }
+    }
+}
+
+const MatchKernel ALL_KERNELS[]={MatchKernel::Scalar, MatchKernel::SSE42, MatchKernel::AVX2, MatchKernel::AVX512};
+
+//Extending long exact and one-SNiP matches, which is nearly all comparing packed words, on each kernel.
+void benchmarkKernels(const vector<Genome>& library, vector<Result>& results)
+{
+    mt19937 rng(11);
+    const int LENGTH=4096;
+    vector<PackedSequence> fragments;
+    vector<int> positions;
+    const Genome* source=&library[0];
+    for (size_t g=0;g<library.size();g++)
+    {
+        if (library[g].length()>source->length())
+            source=&library[g];
+    }
+    if (source->length()<LENGTH)
+        return;
+    for (int q=0;q<2000;q++)
+    {
+        positions.push_back(rng()%(source->length()-LENGTH+1));
+        string fragment;
+        source->extract(positions.back(), LENGTH, fragment);
+        fragments.push_back(PackedSequence(fragment));
+    }
+    for (MatchKernel kernel : ALL_KERNELS)
+    {
+        if (!useMatchKernel(kernel))
+            continue;
+        for (int allowed=0;allowed<=1;allowed++)
+        {
+            Timer timer;
+            long long bases=0;
+            for (int repeat=0;repeat<20;repeat++)
+            {
+                for (size_t q=0;q<fragments.size();q++)
+                {
+                    int snips=allowed;
+                    bases+=fragments[q].extendMatch(0, source->sequence(), positions[q], LENGTH, snips);
+                }
+            }
+            results.push_back(Result{"extendMatch", matchKernelName(kernel), 0, allowed ? "snp" : "exact", bases, "bases", timer.seconds(), -1});
+        }
+    }
+    useMatchKernel(bestMatchKernel());
+}
+
+//how far a matches b from the given positions, stepping over up to allowed mismatches, a base at a time
+int referenceExtend(const string& a, int aPosition, const string& b, int bPosition, int length, int allowed)
+{
+    for (int i=0;i<length;i++)
+    {
+        if (a[aPosition+i]!=b[bPosition+i])
+        {
+            if (allowed==0)
+                return i;
+            allowed--;
+        }
+    }
+    return length;
+}
+
+//Random genomes and pieces of them with a few changes, some with Ns, extended on every kernel the CPU
+//has; each result must equal referenceExtend().
+bool verifyKernels()
+{
+    mt19937 rng(5);
+    bool ok=true;
+    for (MatchKernel kernel : ALL_KERNELS)
+    {
+        if (!useMatchKernel(kernel))
+        {
+            cout << matchKernelName(kernel) << ": not supported by this CPU, skipped" << endl;
+            continue;
+        }
+        int failures=0;
+        for (int trial=0;trial<20000 && failures<5;trial++)
+        {
+            string genome(200+rng()%4000, 'A');
+            for (size_t i=0;i<genome.size();i++)
+                genome[i]="ACGT"[rng()%4];
+            int genomePosition=rng()%genome.size();
+            string fragment=genome.substr(genomePosition);
+            //shift the fragment's copy so its words line up differently
+            int lead=rng()%64;
+            for (int i=0;i<lead;i++)
+                fragment.insert(fragment.begin(), "ACGT"[rng()%4]);
+            for (int changes=rng()%4;changes>0;changes--)
+                fragment[rng()%fragment.size()]="ACGT"[rng()%4];
+            if (rng()%4==0)
+            {
+                int at=lead+rng()%(fragment.size()-lead);
+                fragment[at]='N';
+                if (rng()%2)
+                    genome[genomePosition+at-lead]='N';
+            }
+            int length=static_cast<int>(fragment.size())-lead-static_cast<int>(rng()%8);
+            if (length<0)
+                length=0;
+            int allowed=rng()%3;
+            PackedSequence packedFragment(fragment), packedGenome(genome);
+            int snips=allowed;
+            int found=packedFragment.extendMatch(lead, packedGenome, genomePosition, length, snips);
+            int expected=referenceExtend(fragment, lead, genome, genomePosition, length, allowed);
+            if (found!=expected)
+            {
+                cout << matchKernelName(kernel) << ": extending " << length << " bases from " << lead << " against "
+                     << genomePosition << " with " << allowed << " SNiPs gave " << found << ", expected " << expected << endl;
+                failures++;
+            }
+        }
+        if (failures>0)
+            ok=false;
+        else
+            cout << matchKernelName(kernel) << ": ok" << endl;
+    }
+    useMatchKernel(bestMatchKernel());
+    return ok;
+}
+
+void writeJson(ostream& out, const vector<Result>& results)
+{
+    out << "[" << endl;
+    for (size_t k=0;k<results.size();k++)
+    {
+        const Result& r=results[k];
+        out << "  {\"benchmark\": \"" << r.benchmark << "\", \"engine\": \"" << r.engine
+            << "\", \"minSearchLength\": " << r.minSearchLength << ", \"mode\": \"" << r.mode
+            << "\", \"count\": " << r.count << ", \"unit\": \"" << r.unit
+            << "\", \"seconds\": " << r.seconds << ", \"perSecond\": " << (r.seconds>0 ? r.count/r.seconds : 0)
+            << ", \"bytes\": " << r.bytes << "}" << (k+1<results.size() ? "," : "") << endl;
+    }
+    out << "]" << endl;
+}
+
+void writeCsv(ostream& out, const vector<Result>& results)
+{
+    out << "benchmark,engine,minSearchLength,mode,count,unit,seconds,perSecond,bytes" << endl;
+    for (size_t k=0;k<results.size();k++)
+    {
+        const Result& r=results[k];
+        out << r.benchmark << "," << r.engine << "," << r.minSearchLength << "," << r.mode << ","
+            << r.count << "," << r.unit << "," << r.seconds << "," << (r.seconds>0 ? r.count/r.seconds : 0)
+            << "," << r.bytes << endl;
+    }
+}
+
+void usage()
+{
+    cerr << "usage: benchmark [--data DIR] [--format json|csv] [--out FILE] [--bases N (0 for all)]" << endl
+         << "                 [--k 10,16,24] [--queries N] [--memory-budget BYTES]" << endl
+         << "       benchmark --verify" << endl;
+}
+
+bool parseArguments(int argc, char* argv[], Settings& settings)
+{
+    for (int i=1;i<argc;i++)
+    {
+        string arg=argv[i];
+        if (arg=="--verify")
+        {
+            settings.verify=true;
+            continue;
+        }
+        if (i+1>=argc)
+            return false;
+        string value=argv[++i];
+        if (arg=="--data")
+            settings.dataDir=value;
+        else if (arg=="--format" && (value=="json" || value=="csv"))
+            settings.format=value;
+        else if (arg=="--out")
+            settings.outFile=value;
+        else if (arg=="--bases")
+            settings.maxBases=atoll(value.c_str());
+        else if (arg=="--queries")
+            settings.queries=max(1, atoi(value.c_str()));
+        else if (arg=="--memory-budget")
+            settings.memoryBudget=atoll(value.c_str());
+        else if (arg=="--k")
+        {
+            settings.searchLengths.clear();
+            stringstream list(value);
+            string item;
+            while (getline(list, item, ','))
+            {
+                if (atoi(item.c_str())>0)
+                    settings.searchLengths.push_back(atoi(item.c_str()));
+            }
+            if (settings.searchLengths.empty())
+                return false;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Settings settings;
+    if (!parseArguments(argc, argv, settings))
+    {
+        usage();
+        return 1;
+    }
+    if (settings.verify)
+        return verifyKernels() ? 0 : 1;
+    vector<Result> results;
+    vector<Genome> library;
+    benchmarkLoad(settings, library, results);
+    if (library.empty())
+    {
+        cerr << "No genomes could be loaded from " << settings.dataDir << endl;
+        return 1;
+    }
+    benchmarkKernels(library, results);
+    benchmarkTrie(settings, library, results);
+    benchmarkMatcher(settings, library, IndexEngine::Trie, "trie", results);
+    benchmarkMatcher(settings, library, IndexEngine::SuffixArray, "suffixarray", results);
+    benchmarkMatcher(settings, library, IndexEngine::KmerHash, "kmerhash", results);
+    ofstream outFile;
+    if (!settings.outFile.empty())
+    {
+        outFile.open(settings.outFile);
+        if (!outFile)
+        {
+            cerr << "Cannot write " << settings.outFile << endl;
+            return 1;
+        }
+    }
+    ostream& out=settings.outFile.empty() ? cout : outFile;
+    if (settings.format=="csv")
+        writeCsv(out, results);
+    else
+        writeJson(out, results);
+    return 0;
+}
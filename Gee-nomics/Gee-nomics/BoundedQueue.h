@@ -0,0 +1,62 @@
+#ifndef BOUNDEDQUEUE_INCLUDED
+#define BOUNDEDQUEUE_INCLUDED
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+//A first-in first-out queue between threads that holds at most capacity items: push() waits while it is
+//full and pop() while it is empty, so a fast producer is held to the pace of its consumers.
+//close() ends it: pushes fail from then on, and pops drain what is left and then fail.
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+    : m_capacity(capacity>0 ? capacity : 1), m_closed(false)
+    {
+    }
+    //false, dropping item, if the queue was closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this]() { return m_closed || m_items.size()<m_capacity; });
+        if (m_closed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+    //false once the queue is closed and empty
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+        if (m_items.empty())
+            return false;
+        item=std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed=true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+private:
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+};
+
+#endif // BOUNDEDQUEUE_INCLUDED
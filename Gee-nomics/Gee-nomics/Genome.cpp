@@ -1,4 +1,6 @@
 #include "provided.h"
+#include "PackedSequence.h"
+#include "SequenceReader.h"
 #include <string>
 #include <vector>
 #include <iostream>
@@ -9,78 +11,49 @@ class GenomeImpl
 {
 public:
     GenomeImpl(const string& nm, const string& sequence);
+    GenomeImpl(const string& nm, const PackedSequence& sequence);
     static bool load(istream& genomeSource, vector<Genome>& genomes);
     int length() const;
     string name() const;
     bool extract(int position, int length, string& fragment) const;
+    const PackedSequence& sequence() const;
 private:
     string m_name;
-    string m_sequence;
+    PackedSequence m_sequence;   //2 bits per base, see PackedSequence.h
 };
 
 //set up
 GenomeImpl::GenomeImpl(const string& nm, const string& sequence)
+: m_sequence(sequence)
+{
+    m_name=nm;
+}
+
+//set up from bases that are already packed (e.g. a view into a saved index)
+GenomeImpl::GenomeImpl(const string& nm, const PackedSequence& sequence)
+: m_sequence(sequence)
 {
     m_name=nm;
-    m_sequence=sequence;
 }
 
 //load to genomes from files
+//Every record of a FASTA file, read by a SequenceReader so the library and the queries go by the same rules.
+//The genomes before a record that breaks them are still added.
 bool GenomeImpl::load(istream& genomeSource, vector<Genome>& genomes)
 {
-    string line;
-    string name;
-    string sequence;
-    //get the first line
-    getline(genomeSource,line);
-    if (line.empty())
-        return false;
-    if (line[0]!='>')
-        return false;
-    if (line.substr(1).empty())
-        return false;
-    name=line.substr(1);
-    //while not end of the file
-    while(getline(genomeSource,line))
-    {
-        //can't be empty line in the file
-        if (line.empty())
-            return false;
-        //a name?
-        if (line[0]=='>')
-        {
-            if (sequence.empty())
-                return false;
-            genomes.push_back(Genome(name,sequence));
-            name=line.substr(1);
-            sequence.clear();
-        }
-        //a dna sequence?
-        else
-        {
-            //up to 80
-            if (line.size()>80)
-                return false;
-            for (int i=0;i<line.size();i++)
-            {
-                if (line[i]!='A' && line[i]!='a' && line[i]!='G' && line[i]!='g' && line[i]!='T' && line[i]!='t' && line[i]!='C' && line[i]!='c' && line[i]!='N' && line[i]!='n')
-                    return false;
-            }
-            sequence+=line;
-        }
-    }
-    //the last line should also not be empty
-    if (sequence.empty())
-        return false;
-    genomes.push_back(Genome(name,sequence));
-    return true;
+    SequenceReader reader(genomeSource, '>');
+    size_t before=genomes.size();
+    while (reader.next(genomes))
+        ;
+    //stopped at an error rather than the end, or found nothing at all
+    return reader.error().empty() && genomes.size()>before;
 }
 
 
 //return the length of sequence
 int GenomeImpl::length() const
 {
-    return static_cast<int>(m_sequence.size());
+    return m_sequence.length();
 }
 
 //return the name
@@ -94,12 +67,19 @@ string GenomeImpl::name() const
 //The extract() method must return true if it successfully extracts a string of the specified length, and false otherwise
 bool GenomeImpl::extract(int position, int length, string& fragment) const
 {
-    if ((position+length)>this->length())
+    if (position<0 || length<0 || (position+length)>this->length())
         return false;
-    fragment=m_sequence.substr(position,length);
+    //bases come back upper case, the packed form doesn't keep the original case
+    m_sequence.extract(position,length,fragment);
     return true;
 }
 
+//the packed bases, for callers that compare a word at a time
+const PackedSequence& GenomeImpl::sequence() const
+{
+    return m_sequence;
+}
+
 //******************** Genome functions ************************************
 
 // These functions simply delegate to GenomeImpl's functions.
@@ -110,6 +90,11 @@ Genome::Genome(const string& nm, const string& sequence)
     m_impl = new GenomeImpl(nm, sequence);
 }
 
+Genome::Genome(const string& nm, const PackedSequence& sequence)
+{
+    m_impl = new GenomeImpl(nm, sequence);
+}
+
 Genome::~Genome()
 {
     delete m_impl;
@@ -147,3 +132,8 @@ bool Genome::extract(int position, int length, string& fragment) const
 {
     return m_impl->extract(position, length, fragment);
 }
+
+const PackedSequence& Genome::sequence() const
+{
+    return m_impl->sequence();
+}
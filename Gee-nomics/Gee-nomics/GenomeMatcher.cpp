@@ -1,94 +1,1489 @@
 #include "provided.h"
 #include <unordered_map>
 #include "Trie.h"
+#include "SuffixArray.h"
+#include "KmerTable.h"
+#include "PostingStore.h"
+#include "PackedSequence.h"
+#include "MappedStorage.h"
+#include "ThreadPool.h"
+#include "QueryStats.h"
+#include <memory>
+#include <cstring>
+#include <mutex>
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <cctype>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 using namespace std;
 
+//one raw hit from an index: length bases of the fragment match genome genomeId starting at position
+struct IndexHit
+{
+    int genomeId;
+    int position;
+    int length;
+};
+
+//A query fragment packed once, so candidates can be compared against the genomes a word at a time.
+//Characters that aren't A, C, G, T or N are packed as N but listed in notBases: they match nothing.
+struct PackedFragment
+{
+    PackedSequence bases;
+    vector<int> notBases;
+
+    PackedFragment()
+    {
+    }
+    explicit PackedFragment(const string& fragment)
+    {
+        assign(fragment);
+    }
+    //repack for another fragment, reusing the memory
+    void assign(const string& fragment)
+    {
+        bases.clear();
+        notBases.clear();
+        bases.reserve(static_cast<int>(fragment.size()));
+        for (size_t i=0;i<fragment.size();i++)
+        {
+            bases.append(fragment[i]);
+            if (PackedSequence::code(fragment[i])<0 && fragment[i]!='N' && fragment[i]!='n')
+                notBases.push_back(static_cast<int>(i));
+        }
+    }
+    int length() const
+    {
+        return bases.length();
+    }
+};
+
+//How far the fragment matches the genome starting at pos, with at most one SNiP unless exactMatchOnly.
+//The bases are XORed 32 at a time and the differences walked with count-trailing-zeros, so finding the
+//first and second mismatch costs one step per word rather than per base. Stops at the end of the genome.
+static int extendCandidate(const PackedFragment& fragment, const PackedSequence& gen, int pos, bool exactMatchOnly)
+{
+    int length=min(fragment.length(), gen.length()-pos);
+    int allowed=exactMatchOnly ? 0 : 1;
+    int i=0;
+    //a character that isn't a base is a mismatch wherever it is
+    for (size_t k=0;k<fragment.notBases.size() && fragment.notBases[k]<length;k++)
+    {
+        int bad=fragment.notBases[k];
+        int matched=i+fragment.bases.extendMatch(i, gen, pos+i, bad-i, allowed);
+        if (matched<bad || allowed==0)
+            return matched;
+        allowed--;
+        i=bad+1;
+    }
+    return i+fragment.bases.extendMatch(i, gen, pos+i, length-i, allowed);
+}
+
+//the library's genomes by id; they are shared, never changed, by the snapshots and shards that hold them
+typedef vector<shared_ptr<const Genome>> GenomeList;
+
+//add what a structure holds to one part of usage, and what it views of a mapped file to usage.mapped
+static void addBytes(const ByteCount& count, long long& part, MemoryUsage& usage)
+{
+    part+=count.owned;
+    usage.mapped+=count.mapped;
+}
+
+//The index engines behind GenomeMatcherImpl, picked by GenomeMatcherOptions::engine.
+//An engine reports every place a fragment matches (at most one SNiP, never in the first base, when
+//exactMatchOnly is false) for minimumLength or more bases, and the matcher keeps the best one per genome.
+//A shard is only added to and prepared by the one thread building it; once it is published in a snapshot
+//it is only searched, by any number of threads at once.
+class GenomeIndex
+{
+public:
+    virtual ~GenomeIndex() {}
+    //the shard keeps hold of the genome for as long as it indexes it
+    virtual void addGenome(int genomeId, const shared_ptr<const Genome>& genome)=0;
+    //finish any work an engine leaves until its first search, so that it can be done on a build thread
+    virtual void prepare() {}
+    virtual void findMatches(const string& fragment, int minimumLength, bool exactMatchOnly, vector<IndexHit>& hits) const=0;
+    //search a batch: for each k in order, fragments[k]'s hits are appended to hits[k]. order comes sorted
+    //by the fragments' first minSearchLength bases, so neighbours often share a seed. If skip is given,
+    //genomes with skip[genomeId] set are of no interest and needn't be reported.
+    //By default every fragment is searched on its own and skipped genomes are filtered out after.
+    virtual void findMatches(const string* fragments, const vector<int>& order, int minimumLength, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const
+    {
+        for (size_t i=0;i<order.size();i++)
+        {
+            vector<IndexHit>& found=hits[order[i]];
+            size_t before=found.size();
+            findMatches(fragments[order[i]], minimumLength, exactMatchOnly, found);
+            if (skip)
+                found.erase(remove_if(found.begin()+before, found.end(), [skip](const IndexHit& hit) { return (*skip)[hit.genomeId]; }), found.end());
+        }
+    }
+    //search overlapping windows: window w is the windowLength bases of the query starting at w*stride, and
+    //for each w in [first,last) its hits are appended to hits[w-first]. The query comes both as text and
+    //packed. By default every window is cut out and searched on its own.
+    virtual void findWindows(const string& text, const PackedSequence& /*query*/, int windowLength, int stride, int first, int last, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const
+    {
+        string window;
+        for (int w=first;w<last;w++)
+        {
+            vector<IndexHit>& found=hits[w-first];
+            size_t before=found.size();
+            window.assign(text, static_cast<size_t>(w)*stride, windowLength);
+            findMatches(window, windowLength, exactMatchOnly, found);
+            if (skip)
+                found.erase(remove_if(found.begin()+before, found.end(), [skip](const IndexHit& hit) { return (*skip)[hit.genomeId]; }), found.end());
+        }
+    }
+    //the ids of the genomes in this shard, in the order they were added
+    virtual const vector<int>& genomeIds() const=0;
+    //add the memory the index holds to usage (the genomes themselves belong to the library)
+    virtual void memoryUsage(MemoryUsage& usage) const=0;
+    //the engine's part of a saved library; load() leaves the index a view into the reader's file,
+    //taking its genomes from the library's list
+    virtual void save(IndexWriter& writer) const=0;
+    virtual bool load(IndexReader& reader, const GenomeList& library)=0;
+};
+
+//one of a shard's genomes (counted in the order they were added) and a position in it
+struct GenomePosition
+{
+    int genome;
+    int position;
+};
+
+//The engines that look up a fragment's first minSearchLength bases (its seed) and then extend every
+//place the seed occurs against the packed genome to see how long the match really is.
+//A seed's occurrences are kept as offsets into the shard's genomes laid end to end, one int each, in
+//compressed posting lists. Work an engine puts off until its first search is done by finish(), once.
+//
+//With a minimizer window w > 1 the seeds are only seedLength = minSearchLength-w+1 bases long and just
+//the (w,k)-minimizers are indexed: of every w consecutive seeds, the one whose hashed key is smallest.
+//A match of minSearchLength or more bases covers a whole window, and the fragment's copy of that window
+//picks the same minimizer, so looking it up (every seed of the window, when a SNiP may have changed
+//which one it is) still finds every match. About 2/(w+1) of the positions end up in the index.
+class SeedIndex : public GenomeIndex
+{
+public:
+    SeedIndex(int minSearchLength, int window);
+    void prepare() override;
+    void findMatches(const string& fragment, int minimumLength, bool exactMatchOnly, vector<IndexHit>& hits) const override;
+    void findMatches(const string* fragments, const vector<int>& order, int minimumLength, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const override;
+    void findWindows(const string& text, const PackedSequence& query, int windowLength, int stride, int first, int last, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const override;
+    const vector<int>& genomeIds() const override
+    {
+        return m_ids;
+    }
+protected:
+    int m_minSearchLength;
+    int m_window;
+    int m_seedLength;
+    mutable mutex m_buildMutex;
+    //append every place seed occurs, with one SNiP (never in its first base) unless exactMatchOnly
+    virtual void findSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const=0;
+    //keep[i] is set if the seed at position i is to be indexed; false (keep untouched) when every one is
+    bool sampleSeeds(const PackedSequence& bases, vector<char>& keep) const;
+    //called with m_buildMutex held before any search
+    virtual void finish() const {}
+    //give a genome its range of offsets, returning the first
+    int place(int genomeId, const shared_ptr<const Genome>& genome);
+    //the genome and position an offset stands for
+    GenomePosition locate(int offset) const
+    {
+        //the genome this offset falls in is the last one starting at or before it
+        int g=static_cast<int>(upper_bound(m_starts.begin(), m_starts.end(), offset)-m_starts.begin())-1;
+        return GenomePosition{g, offset-m_starts[g]};
+    }
+    void saveLayout(IndexWriter& writer) const;
+    bool loadLayout(IndexReader& reader, const GenomeList& library);
+    //count where the genomes lie as index
+    void countLayout(MemoryUsage& usage) const;
+private:
+    vector<int> m_starts;   //where each genome begins in the shard's offsets, in order
+    vector<int> m_ids;      //and the id of that genome
+    GenomeList m_genomes;   //and the genome itself
+    int m_size;             //the offset the next genome starts at
+    mutable atomic<bool> m_finished;
+
+    //searches only take the mutex until the work is done
+    void ensureFinished() const
+    {
+        if (m_finished.load(memory_order_acquire))
+            return;
+        lock_guard<mutex> lock(m_buildMutex);
+        finish();
+        m_finished.store(true, memory_order_release);
+    }
+    //a hit on candidate c for length bases
+    IndexHit hit(const GenomePosition& c, int length) const
+    {
+        return IndexHit{m_ids[c.genome], c.position, length};
+    }
+    //findSeed, counted in the statistics
+    void lookupSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const
+    {
+        size_t before=candidates.size();
+        findSeed(seed, exactMatchOnly, candidates);
+        GEENOMICS_COUNT(seedLookups, 1);
+        GEENOMICS_RECORD(candidatesPerSeed, candidates.size()-before);
+    }
+    //append every place a fragment starting with region (its first minSearchLength bases) may match
+    void findCandidates(string_view region, bool exactMatchOnly, vector<GenomePosition>& candidates) const;
+    //decide windows [from,to] (see findWindows) against the genome of candidate c along the diagonal
+    //c.position-offset, appending a hit for each one that matches there; returns how many don't
+    int matchDiagonal(const PackedSequence& query, const GenomePosition& c, int offset, int from, int to, int windowLength, int stride, bool exactMatchOnly, vector<vector<IndexHit>>& hits, int first) const;
+    //extend each candidate for fragment, keeping those reaching minimumLength as hits
+    void extendCandidates(const PackedFragment& fragment, const vector<GenomePosition>& candidates, int minimumLength, bool exactMatchOnly, const vector<char>* skip, vector<IndexHit>& hits) const;
+    //what minimizers are picked by: the seed's last 32 bases (packed into key) hashed, so that runs
+    //of common seeds don't all win; a seed holding an N or anything else never wins over one without
+    static uint64_t seedOrder(uint64_t key, bool hasBadBase)
+    {
+        if (hasBadBase)
+            return ~0ULL;
+        key^=key>>33;
+        key*=0xff51afd7ed558ccdULL;
+        key^=key>>33;
+        key*=0xc4ceb9fe1a85ec53ULL;
+        key^=key>>33;
+        return key;
+    }
+};
+
+SeedIndex::SeedIndex(int minSearchLength, int window)
+: m_minSearchLength(minSearchLength), m_window(window), m_seedLength(minSearchLength-window+1), m_size(0), m_finished(false)
+{
+}
+
+//Hash every seed of the genome with a rolling key, then slide a window of m_window seeds along,
+//keeping the leftmost smallest in a deque, and mark the one at its front.
+bool SeedIndex::sampleSeeds(const PackedSequence& bases, vector<char>& keep) const
+{
+    if (m_window==1)
+        return false;
+    int k=m_seedLength;
+    int seeds=max(bases.length()-k+1, 0);
+    keep.assign(seeds, 0);
+    if (seeds<m_window)
+        return true;
+    vector<uint64_t> order(seeds);
+    uint64_t mask=(k>=PackedSequence::BASES_PER_WORD) ? ~0ULL : (1ULL<<(2*k))-1;
+    uint64_t key=0;
+    int lastN=-1;
+    for (int i=0;i<bases.length();i+=PackedSequence::BASES_PER_WORD)
+    {
+        uint64_t codes=bases.codes(i);
+        uint64_t ns=bases.nMask(i);
+        int end=min(bases.length()-i, PackedSequence::BASES_PER_WORD);
+        for (int j=0;j<end;j++,codes>>=2,ns>>=2)
+        {
+            key=((key<<2)|(codes&3))&mask;
+            if (ns&1)
+                lastN=i+j;
+            int start=i+j-k+1;
+            if (start>=0)
+                order[start]=seedOrder(key, lastN>=start);
+        }
+    }
+    deque<int> window;
+    for (int i=0;i<seeds;i++)
+    {
+        //a later seed that is no bigger can't lose to an earlier one any more
+        while (!window.empty() && order[window.back()]>order[i])
+            window.pop_back();
+        window.push_back(i);
+        if (window.front()<=i-m_window)
+            window.pop_front();
+        if (i>=m_window-1)
+            keep[window.front()]=1;
+    }
+    return true;
+}
+
+//Without sampling this is the seed itself. With it, exact matches come from the window's minimizer alone;
+//with a SNiP allowed any seed of the window may be the genome's minimizer, so all of them are looked up,
+//including with the SNiP in their first base (which is only the fragment's first base for the first seed).
+//A hit on the seed at j means the match would start j bases earlier.
+void SeedIndex::findCandidates(string_view region, bool exactMatchOnly, vector<GenomePosition>& candidates) const
+{
+    GEENOMICS_TIME(lookupNanos);
+    size_t first=candidates.size();
+    if (m_window==1)
+    {
+        lookupSeed(region, exactMatchOnly, candidates);
+        GEENOMICS_COUNT(candidates, candidates.size()-first);
+        return;
+    }
+    if (static_cast<int>(region.size())<m_minSearchLength)
+        return;
+    int k=m_seedLength;
+    uint64_t mask=(k>=PackedSequence::BASES_PER_WORD) ? ~0ULL : (1ULL<<(2*k))-1;
+    uint64_t key=0;
+    int lastBad=-1;
+    int minimizer=0;
+    uint64_t smallest=~0ULL;
+    for (int i=0;i<m_minSearchLength;i++)
+    {
+        int c=PackedSequence::code(region[i]);
+        if (c<0)
+            lastBad=i;
+        key=((key<<2)|(c<0 ? 0 : c))&mask;
+        int start=i-k+1;
+        if (start>=0 && (start==0 || seedOrder(key, lastBad>=start)<smallest))
+        {
+            smallest=seedOrder(key, lastBad>=start);
+            minimizer=start;
+        }
+    }
+    string variant;
+    for (int j=0;j<m_window;j++)
+    {
+        if (exactMatchOnly && j!=minimizer)
+            continue;
+        size_t before=candidates.size();
+        string_view seed=region.substr(j, k);
+        lookupSeed(seed, exactMatchOnly, candidates);
+        if (!exactMatchOnly && j>0)
+        {
+            variant.assign(seed);
+            for (const char* c="ACGTN";*c;c++)
+            {
+                if (*c==toupper(static_cast<unsigned char>(seed[0])))
+                    continue;
+                variant[0]=*c;
+                lookupSeed(variant, true, candidates);
+            }
+        }
+        for (size_t f=before;f<candidates.size();f++)
+            candidates[f].position-=j;
+    }
+    //the same start can be reached through several seeds, and the fragment's first base must match exactly
+    char firstBase=static_cast<char>(toupper(static_cast<unsigned char>(region[0])));
+    auto unwanted=[&](const GenomePosition& p) { return p.position<0 || m_genomes[p.genome]->sequence().at(p.position)!=firstBase; };
+    GEENOMICS_COUNT(candidates, candidates.size()-first);
+    size_t found=candidates.size();
+    candidates.erase(remove_if(candidates.begin()+first, candidates.end(), unwanted), candidates.end());
+    GEENOMICS_COUNT(candidatesRejected, found-candidates.size());
+    if (!exactMatchOnly)
+    {
+        auto less=[](const GenomePosition& a, const GenomePosition& b) { return a.genome<b.genome || (a.genome==b.genome && a.position<b.position); };
+        auto same=[](const GenomePosition& a, const GenomePosition& b) { return a.genome==b.genome && a.position==b.position; };
+        sort(candidates.begin()+first, candidates.end(), less);
+        candidates.erase(unique(candidates.begin()+first, candidates.end(), same), candidates.end());
+    }
+}
+
+void SeedIndex::prepare()
+{
+    ensureFinished();
+}
+
+int SeedIndex::place(int genomeId, const shared_ptr<const Genome>& genome)
+{
+    m_starts.push_back(m_size);
+    m_ids.push_back(genomeId);
+    m_genomes.push_back(genome);
+    m_size+=genome->length();
+    m_finished=false;
+    return m_starts.back();
+}
+
+void SeedIndex::saveLayout(IndexWriter& writer) const
+{
+    writer.writeArray(m_starts);
+    writer.writeArray(m_ids);
+    writer.write(static_cast<int32_t>(m_size));
+}
+
+void SeedIndex::countLayout(MemoryUsage& usage) const
+{
+    ByteCount layout;
+    layout.add(m_starts);
+    layout.add(m_ids);
+    layout.add(m_genomes);
+    addBytes(layout, usage.index, usage);
+}
+
+bool SeedIndex::loadLayout(IndexReader& reader, const GenomeList& library)
+{
+    int32_t size;
+    if (!reader.readArray(m_starts) || !reader.readArray(m_ids) || m_starts.size()!=m_ids.size() || !reader.read(size))
+        return false;
+    m_genomes.clear();
+    for (size_t k=0;k<m_ids.size();k++)
+    {
+        if (m_ids[k]<0 || static_cast<size_t>(m_ids[k])>=library.size())
+            return false;
+        m_genomes.push_back(library[m_ids[k]]);
+    }
+    m_size=size;
+    return true;
+}
+
+void SeedIndex::findMatches(const string& fragment, int minimumLength, bool exactMatchOnly, vector<IndexHit>& hits) const
+{
+    ensureFinished();
+    GEENOMICS_COUNT(fragments, 1);
+    vector<GenomePosition> searchResult;
+    findCandidates(string_view(fragment).substr(0,m_minSearchLength), exactMatchOnly, searchResult);
+    GEENOMICS_COUNT(bufferBytes, searchResult.capacity()*sizeof(GenomePosition));
+    PackedFragment packed(fragment);
+    extendCandidates(packed, searchResult, minimumLength, exactMatchOnly, nullptr, hits);
+}
+
+//Extend every candidate against the packed genome, nothing is copied. Candidates in genomes with
+//(*skip)[id] set are passed over.
+void SeedIndex::extendCandidates(const PackedFragment& fragment, const vector<GenomePosition>& candidates, int minimumLength, bool exactMatchOnly, const vector<char>* skip, vector<IndexHit>& hits) const
+{
+    GEENOMICS_TIME(extensionNanos);
+    size_t capacity=hits.capacity();
+    long long rejected=0;
+    for (size_t k=0;k<candidates.size();k++)
+    {
+        if (skip && (*skip)[m_ids[candidates[k].genome]])
+            continue;
+        int totalLength=extendCandidate(fragment, m_genomes[candidates[k].genome]->sequence(), candidates[k].position, exactMatchOnly);
+        GEENOMICS_RECORD(extensionLength, totalLength);
+        if (totalLength>=minimumLength)
+            hits.push_back(hit(candidates[k], totalLength));
+        else
+            rejected++;
+    }
+    GEENOMICS_COUNT(candidatesRejected, rejected);
+    GEENOMICS_COUNT(bufferBytes, (hits.capacity()-capacity)*sizeof(IndexHit));
+}
+
+//Fragments with the same seed come one after another, so the seed is looked up once per distinct seed
+//and its hits are extended for each of them (apart from the ones in skipped genomes).
+void SeedIndex::findMatches(const string* fragments, const vector<int>& order, int minimumLength, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const
+{
+    ensureFinished();
+    vector<GenomePosition> searchResult;
+    PackedFragment packed;
+    string_view lastSeed;
+    for (size_t i=0;i<order.size();i++)
+    {
+        const string& fragment=fragments[order[i]];
+        string_view seed=string_view(fragment).substr(0,m_minSearchLength);
+        if (i==0 || seed!=lastSeed)
+        {
+            searchResult.clear();
+            findCandidates(seed, exactMatchOnly, searchResult);
+            lastSeed=seed;
+        }
+        packed.assign(fragment);
+        GEENOMICS_COUNT(fragments, 1);
+        extendCandidates(packed, searchResult, minimumLength, exactMatchOnly, skip, hits[order[i]]);
+    }
+    GEENOMICS_COUNT(bufferBytes, searchResult.capacity()*sizeof(GenomePosition));
+}
+
+//The mismatches along the diagonal are found once, as the windows move forward: a window matches if none
+//falls inside it (or, with a SNiP allowed, one that isn't its first base), and every window up to a
+//mismatch ruling one out is ruled out by it too, so they are skipped.
+int SeedIndex::matchDiagonal(const PackedSequence& query, const GenomePosition& c, int offset, int from, int to, int windowLength, int stride, bool exactMatchOnly, vector<vector<IndexHit>>& hits, int first) const
+{
+    const PackedSequence& gen=m_genomes[c.genome]->sequence();
+    int diagonal=c.position-offset;
+    //only windows inside [begin,end) line up with the genome at all
+    int begin=max(from*stride, -diagonal);
+    int end=min(min(to*stride+windowLength, query.length()), gen.length()-diagonal);
+    //the first mismatch at or after pos, or end if there is none
+    auto nextMismatch=[&](int pos)
+    {
+        return (pos>=end) ? end : pos+query.firstMismatch(pos, gen, pos+diagonal, end-pos);
+    };
+    int matched=0;
+    int w=max(from, (begin+stride-1)/stride);
+    int mismatch=-1, second=-1;   //the first two mismatches at or after window w, once found
+    while (w<=to && w*stride+windowLength<=end)
+    {
+        int o=w*stride;
+        if (mismatch<o)
+        {
+            mismatch=(second>=o) ? second : nextMismatch(o);
+            second=-1;
+        }
+        if (mismatch>=o+windowLength)
+        {
+            hits[w-first].push_back(hit(GenomePosition{c.genome, o+diagonal}, windowLength));
+            matched++;
+            w++;
+            continue;
+        }
+        if (!exactMatchOnly && mismatch!=o)
+        {
+            if (second<0)
+                second=nextMismatch(mismatch+1);
+            if (second>=o+windowLength)
+            {
+                hits[w-first].push_back(hit(GenomePosition{c.genome, o+diagonal}, windowLength));
+                matched++;
+                w++;
+                continue;
+            }
+        }
+        //every later window starting at or before the mismatch holds the same mismatches
+        w=mismatch/stride+1;
+    }
+    return to-from+1-matched;
+}
+
+//Every window holding a match holds the match's seed, so rather than look up each window's own seed, this
+//looks up the seeds (minSearchLength bases) at a sample of query offsets, just dense enough that every
+//window holds one of them whole, and each lookup serves all the windows around it. Exactly a window apart
+//does for exact matches; with a SNiP allowed every window holds two, since the SNiP may be the first base
+//of one of them, which its lookup can't match. (With a stride above that spacing the windows' own seeds
+//are fewer and are used instead.) A candidate pins down a diagonal, a genome position minus a query offset,
+//and the windows whose first seed this is are decided along it at once, along with the ones before them
+//whose first seed's first base is a mismatch on the diagonal. No window is decided twice on one diagonal.
+void SeedIndex::findWindows(const string& text, const PackedSequence& query, int windowLength, int stride, int first, int last, bool exactMatchOnly, const vector<char>* skip, vector<vector<IndexHit>>& hits) const
+{
+    ensureFinished();
+    int k=m_minSearchLength;
+    int seedsPerWindow=windowLength-k+1;
+    int spacing=exactMatchOnly ? seedsPerWindow : max(1, seedsPerWindow/2);
+    if (stride>=spacing)
+        spacing=stride;
+    vector<GenomePosition> searchResult;
+    long long rejected=0;
+    //from the first seed in window first to the last in window last-1
+    int lastSeed=(last-1)*stride+windowLength-k;
+    for (int q=(first*stride+spacing-1)/spacing*spacing;q<=lastSeed;q+=spacing)
+    {
+        //the windows starting after the seed before this one and holding this one whole; the ones starting
+        //after the seed before that may come from this one too
+        int to=min(last-1, q/stride);
+        int from=max(first, (max({q-spacing+1, q+k-windowLength, 0})+stride-1)/stride);
+        int earlier=exactMatchOnly ? from : max(first, (max({q-2*spacing+1, q+k-windowLength, 0})+stride-1)/stride);
+        if (earlier>to)
+            continue;
+        searchResult.clear();
+        findCandidates(string_view(text).substr(q, k), exactMatchOnly, searchResult);
+        GEENOMICS_COUNT(fragments, 1);
+        GEENOMICS_TIME(extensionNanos);
+        for (size_t i=0;i<searchResult.size();i++)
+        {
+            const GenomePosition& c=searchResult[i];
+            if (skip && (*skip)[m_ids[c.genome]])
+                continue;
+            int start=from;
+            if (earlier<from)
+            {
+                const PackedSequence& gen=m_genomes[c.genome]->sequence();
+                int before=c.position-spacing;
+                if (before<0 || query.firstMismatch(q-spacing, gen, before, 1)==0)
+                    start=earlier;
+            }
+            if (start<=to)
+                rejected+=matchDiagonal(query, c, q, start, to, windowLength, stride, exactMatchOnly, hits, first);
+        }
+    }
+    GEENOMICS_COUNT(candidatesRejected, rejected);
+    GEENOMICS_COUNT(bufferBytes, searchResult.capacity()*sizeof(GenomePosition));
+}
+
+//every seed goes in a SeedTrie (a Trie, or a KmerTrie of the seed length), which maps it to the id of
+//its posting list
+template<typename SeedTrie>
+class TrieIndex : public SeedIndex
+{
+public:
+    TrieIndex(int minSearchLength, int window);
+    void addGenome(int genomeId, const shared_ptr<const Genome>& genome) override;
+    void memoryUsage(MemoryUsage& usage) const override;
+    void save(IndexWriter& writer) const override;
+    bool load(IndexReader& reader, const GenomeList& library) override;
+protected:
+    void findSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const override;
+    void finish() const override;
+private:
+    SeedTrie trie;
+    mutable PostingStore m_postings;
+};
+
+template<typename SeedTrie>
+TrieIndex<SeedTrie>::TrieIndex(int minSearchLength, int window)
+: SeedIndex(minSearchLength, window)
+{
+}
+
+template<typename SeedTrie>
+void TrieIndex<SeedTrie>::addGenome(int genomeId, const shared_ptr<const Genome>& genome)
+{
+    int start=place(genomeId, genome);
+    vector<char> keep;
+    bool sampled=sampleSeeds(genome->sequence(), keep);
+    string fragment;
+    for (int i=0;genome->extract(i, m_seedLength, fragment);i++)
+    {
+        if (sampled && !keep[i])
+            continue;
+        //the first time a prefix is seen it gets a new list
+        const int* list=trie.findOrInsert(fragment, m_postings.lists());
+        if (list==nullptr)
+            continue;
+        if (*list==m_postings.lists())
+            m_postings.newList();
+        m_postings.append(*list, start+i);
+    }
+}
+
+template<typename SeedTrie>
+void TrieIndex<SeedTrie>::finish() const
+{
+    m_postings.seal();
+}
+
+template<typename SeedTrie>
+void TrieIndex<SeedTrie>::findSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const
+{
+    QueryCount visited=QueryCount();
+    trie.forEach(seed, exactMatchOnly, [&](int list)
+    {
+        m_postings.forEach(list, [&](int offset) { candidates.push_back(locate(offset)); });
+    }, visited);
+    GEENOMICS_COUNT(trieNodesVisited, visited);
+}
+
+template<typename SeedTrie>
+void TrieIndex<SeedTrie>::memoryUsage(MemoryUsage& usage) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    countLayout(usage);
+    ByteCount nodes, lists, pending;
+    trie.countBytes(nodes);
+    m_postings.countBytes(lists, pending);
+    addBytes(nodes, usage.index, usage);
+    addBytes(lists, usage.postings, usage);
+    addBytes(pending, usage.scratch, usage);
+}
+
+template<typename SeedTrie>
+void TrieIndex<SeedTrie>::save(IndexWriter& writer) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    m_postings.seal();
+    saveLayout(writer);
+    trie.save(writer);
+    m_postings.save(writer);
+}
+
+template<typename SeedTrie>
+bool TrieIndex<SeedTrie>::load(IndexReader& reader, const GenomeList& library)
+{
+    return loadLayout(reader, library) && trie.load(reader) && m_postings.load(reader);
+}
+
+//the common seed lengths get a trie specialised for that depth, the others the general one
+static GenomeIndex* newTrieIndex(int minSearchLength, int window)
+{
+    GenomeIndex* index=nullptr;
+    bool fixed=withKmerTrieDepth(minSearchLength-window+1, [&](auto depth)
+    {
+        index=new TrieIndex<KmerTrie<int, decltype(depth)::value>>(minSearchLength, window);
+    });
+    if (!fixed)
+        index=new TrieIndex<Trie<int>>(minSearchLength, window);
+    return index;
+}
+
+//For seeds of up to 32 bases: every seed is packed into a 64-bit key in a KmerTable, flat
+//sorted arrays instead of a tree. The few k-mers with an N can't be packed and go in a small overflow
+//Trie of their offsets. SNiPs are found by looking up each of the 3*(k-1) keys one substitution away.
+class KmerIndex : public SeedIndex
+{
+public:
+    //pending k-mers past spillBudget bytes are spilled to spillDirectory (see KmerTable::setSpill)
+    KmerIndex(int minSearchLength, int window, size_t spillBudget, const string& spillDirectory);
+    void addGenome(int genomeId, const shared_ptr<const Genome>& genome) override;
+    void memoryUsage(MemoryUsage& usage) const override;
+    void save(IndexWriter& writer) const override;
+    bool load(IndexReader& reader, const GenomeList& library) override;
+protected:
+    void findSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const override;
+    void finish() const override;
+private:
+    mutable KmerTable m_table;
+    Trie<int> m_overflow;   //offsets, like the table
+
+    //look up one packed k-mer and append where it occurs
+    void findKmer(uint64_t kmer, vector<GenomePosition>& candidates) const;
+    //build the table, which must not fail
+    void buildTable() const;
+};
+
+KmerIndex::KmerIndex(int minSearchLength, int window, size_t spillBudget, const string& spillDirectory)
+: SeedIndex(minSearchLength, window), m_table(minSearchLength-window+1)
+{
+    m_table.setSpill(spillBudget, spillDirectory);
+}
+
+void KmerIndex::addGenome(int genomeId, const shared_ptr<const Genome>& genome)
+{
+    int offset=place(genomeId, genome);
+    const PackedSequence& bases=genome->sequence();
+    vector<char> keep;
+    bool sampled=sampleSeeds(bases, keep);
+    int k=m_seedLength;
+    uint64_t mask=(k==KmerTable::MAX_K) ? ~0ULL : (1ULL<<(2*k))-1;
+    uint64_t kmer=0;
+    int lastN=-1;
+    string window;
+    //roll the key forward 32 bases at a time, straight off the packed words
+    for (int i=0;i<bases.length();i+=PackedSequence::BASES_PER_WORD)
+    {
+        uint64_t codes=bases.codes(i);
+        uint64_t ns=bases.nMask(i);
+        int end=min(bases.length()-i, PackedSequence::BASES_PER_WORD);
+        for (int j=0;j<end;j++,codes>>=2,ns>>=2)
+        {
+            kmer=((kmer<<2)|(codes&3))&mask;
+            if (ns&1)
+                lastN=i+j;
+            int start=i+j-k+1;
+            if (start<0 || (sampled && !keep[start]))
+                continue;
+            if (lastN>=start)
+            {
+                bases.extract(start, k, window);
+                m_overflow.insert(window, offset+start);
+            }
+            else
+                m_table.insert(kmer, offset+start);
+        }
+    }
+}
+
+void KmerIndex::finish() const
+{
+    buildTable();
+}
+
+void KmerIndex::buildTable() const
+{
+    //the k-mers in a spilled run that can't be read back are gone, and an index without them would quietly
+    //miss matches, so there is nothing to do but stop
+    if (!m_table.build())
+    {
+        cerr << "Cannot read back the k-mers spilled to disk while building the index" << endl;
+        abort();
+    }
+}
+
+void KmerIndex::findKmer(uint64_t kmer, vector<GenomePosition>& candidates) const
+{
+    m_table.forEach(kmer, [&](int offset) { candidates.push_back(locate(offset)); });
+}
+void KmerIndex::findSeed(string_view seed, bool exactMatchOnly, vector<GenomePosition>& candidates) const
+{
+    int k=m_seedLength;
+    //windows holding an N only ever match through the overflow trie
+    QueryCount visited=QueryCount();
+    m_overflow.forEach(seed, exactMatchOnly, [&](int offset) { candidates.push_back(locate(offset)); }, visited);
+    GEENOMICS_COUNT(trieNodesVisited, visited);
+    if (static_cast<int>(seed.size())<k)
+        return;
+    uint64_t kmer=0;
+    int badCount=0, bad=0;
+    for (int i=0;i<k;i++)
+    {
+        int c=PackedSequence::code(seed[i]);
+        if (c<0)
+        {
+            badCount++;
+            bad=i;
+            c=0;
+        }
+        kmer=(kmer<<2)|c;
+    }
+    //an N or anything else in the seed can only be the one SNiP
+    if (badCount==0)
+        findKmer(kmer, candidates);
+    if (exactMatchOnly || badCount>1 || (badCount==1 && bad==0))
+        return;
+    for (int i=(badCount==1 ? bad : 1);i<k;i++)
+    {
+        int shift=2*(k-1-i);
+        uint64_t original=(kmer>>shift)&3;
+        for (uint64_t c=0;c<4;c++)
+        {
+            if (c!=original || badCount==1)
+                findKmer((kmer&~(3ULL<<shift))|(c<<shift), candidates);
+        }
+        if (badCount==1)
+            break;
+    }
+}
+
+void KmerIndex::memoryUsage(MemoryUsage& usage) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    countLayout(usage);
+    ByteCount table, lists, pending, overflow;
+    m_table.countBytes(table, lists, pending);
+    m_overflow.countBytes(overflow);
+    addBytes(table, usage.index, usage);
+    addBytes(overflow, usage.index, usage);
+    addBytes(lists, usage.postings, usage);
+    addBytes(pending, usage.scratch, usage);
+}
+
+void KmerIndex::save(IndexWriter& writer) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    saveLayout(writer);
+    buildTable();
+    m_table.save(writer);
+    m_overflow.save(writer);
+}
+
+bool KmerIndex::load(IndexReader& reader, const GenomeList& library)
+{
+    return loadLayout(reader, library) && m_table.load(reader) && m_overflow.load(reader);
+}
+
+//A suffix array over every genome laid end to end, with a separator after each.
+//A fragment is matched by narrowing the range of suffixes that start with it one base at a time;
+//a suffix that drops out at depth d matched exactly d bases, so hits never need extending and any
+//fragment length works. The array is sorted lazily, on the first search after genomes are added.
+class SuffixArrayIndex : public GenomeIndex
+{
+public:
+    SuffixArrayIndex();
+    void addGenome(int genomeId, const shared_ptr<const Genome>& genome) override;
+    void prepare() override;
+    void findMatches(const string& fragment, int minimumLength, bool exactMatchOnly, vector<IndexHit>& hits) const override;
+    const vector<int>& genomeIds() const override
+    {
+        return m_ids;
+    }
+    void memoryUsage(MemoryUsage& usage) const override;
+    void save(IndexWriter& writer) const override;
+    bool load(IndexReader& reader, const GenomeList& library) override;
+private:
+    static const uint8_t NOT_A_BASE=6;   //a fragment character that can't match anything
+    mutable SuffixArray m_suffixArray;
+    mutable mutex m_buildMutex;
+    mutable atomic<bool> m_sorted;   //searches only take the mutex until the array is sorted
+    vector<int> m_starts;   //where each genome begins in the text, in text order
+    vector<int> m_ids;      //and the id of that genome
+
+    static uint8_t symbol(char base)
+    {
+        int c=PackedSequence::code(base);
+        if (c>=0)
+            return static_cast<uint8_t>(c+1);
+        return (base=='N' || base=='n') ? 5 : NOT_A_BASE;
+    }
+    //report every suffix ranked in [lo,hi) as a match of length bases
+    void report(int lo, int hi, int length, int minimumLength, vector<IndexHit>& hits) const;
+    //follow key from depth exactly, reporting suffixes as they drop out
+    void extendExact(int lo, int hi, int depth, const vector<uint8_t>& key, int minimumLength, vector<IndexHit>& hits) const;
+};
+
+SuffixArrayIndex::SuffixArrayIndex()
+: m_sorted(false)
+{
+}
+
+void SuffixArrayIndex::addGenome(int genomeId, const shared_ptr<const Genome>& genome)
+{
+    m_starts.push_back(m_suffixArray.size());
+    m_ids.push_back(genomeId);
+    m_sorted=false;
+    string bases;
+    genome->extract(0, genome->length(), bases);
+    for (size_t i=0;i<bases.size();i++)
+        m_suffixArray.append(symbol(bases[i]));
+    m_suffixArray.append(SuffixArray::SEPARATOR);
+}
+
+void SuffixArrayIndex::report(int lo, int hi, int length, int minimumLength, vector<IndexHit>& hits) const
+{
+    if (length<minimumLength)
+        return;
+    for (int r=lo;r<hi;r++)
+    {
+        int position=m_suffixArray.suffix(r);
+        //the genome this position falls in is the last one starting at or before it
+        int k=static_cast<int>(upper_bound(m_starts.begin(), m_starts.end(), position)-m_starts.begin())-1;
+        hits.push_back(IndexHit{m_ids[k], position-m_starts[k], length});
+    }
+}
+
+void SuffixArrayIndex::extendExact(int lo, int hi, int depth, const vector<uint8_t>& key, int minimumLength, vector<IndexHit>& hits) const
+{
+    int length=static_cast<int>(key.size());
+    for (;depth<length && lo<hi;depth++)
+    {
+        int newLo=lo, newHi=hi;
+        m_suffixArray.narrow(newLo, newHi, depth, key[depth]);
+        //whatever is left out on either side stopped matching here
+        report(lo, newLo, depth, minimumLength, hits);
+        report(newHi, hi, depth, minimumLength, hits);
+        lo=newLo;
+        hi=newHi;
+    }
+    report(lo, hi, depth, minimumLength, hits);
+}
+
+void SuffixArrayIndex::prepare()
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    if (!m_suffixArray.built())
+        m_suffixArray.build();
+    m_sorted=true;
+}
+
+//The lookup and the extension are one walk down the suffix array, so its statistics count it all as lookup.
+void SuffixArrayIndex::findMatches(const string& fragment, int minimumLength, bool exactMatchOnly, vector<IndexHit>& hits) const
+{
+    if (!m_sorted.load(memory_order_acquire))
+    {
+        lock_guard<mutex> lock(m_buildMutex);
+        if (!m_suffixArray.built())
+            m_suffixArray.build();
+        m_sorted.store(true, memory_order_release);
+    }
+    GEENOMICS_COUNT(fragments, 1);
+    GEENOMICS_TIME(lookupNanos);
+    vector<uint8_t> key(fragment.size());
+    for (size_t i=0;i<fragment.size();i++)
+        key[i]=symbol(fragment[i]);
+    if (exactMatchOnly)
+    {
+        extendExact(0, m_suffixArray.size(), 0, key, minimumLength, hits);
+        return;
+    }
+    //walk the exact path, and at every depth but the first also branch off with the one SNiP
+    int lo=0, hi=m_suffixArray.size();
+    int depth=0;
+    int length=static_cast<int>(key.size());
+    for (;depth<length && lo<hi;depth++)
+    {
+        int newLo=lo, newHi=hi;
+        m_suffixArray.narrow(newLo, newHi, depth, key[depth]);
+        if (depth==0)
+        {
+            report(lo, newLo, depth, minimumLength, hits);
+            report(newHi, hi, depth, minimumLength, hits);
+        }
+        else
+        {
+            //suffixes that left the path used their SNiP here and carry on exactly,
+            //except the ones that reached the end of their genome
+            for (uint8_t s=1;s<=5;s++)
+            {
+                if (s==key[depth])
+                    continue;
+                int branchLo=lo, branchHi=hi;
+                m_suffixArray.narrow(branchLo, branchHi, depth, s);
+                extendExact(branchLo, branchHi, depth+1, key, minimumLength, hits);
+            }
+            int endLo=lo, endHi=hi;
+            m_suffixArray.narrow(endLo, endHi, depth, SuffixArray::SEPARATOR);
+            report(endLo, endHi, depth, minimumLength, hits);
+        }
+        lo=newLo;
+        hi=newHi;
+    }
+    report(lo, hi, depth, minimumLength, hits);
+}
+
+void SuffixArrayIndex::memoryUsage(MemoryUsage& usage) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    ByteCount array;
+    m_suffixArray.countBytes(array);
+    array.add(m_starts);
+    array.add(m_ids);
+    addBytes(array, usage.index, usage);
+}
+
+void SuffixArrayIndex::save(IndexWriter& writer) const
+{
+    lock_guard<mutex> lock(m_buildMutex);
+    writer.writeArray(m_starts);
+    writer.writeArray(m_ids);
+    m_suffixArray.save(writer);
+}
+
+bool SuffixArrayIndex::load(IndexReader& reader, const GenomeList&)
+{
+    if (!reader.readArray(m_starts) || !reader.readArray(m_ids) || m_starts.size()!=m_ids.size() || !m_suffixArray.load(reader))
+        return false;
+    m_sorted=true;
+    return true;
+}
+
+//One version of the library: everything a search reads. A published snapshot is never changed again;
+//a change copies the current one, edits the copy and publishes it with one atomic store, so a search
+//works on the version it picked up when it started, however long it runs, and never waits on a writer.
+//An old version, with any shard or genome only it still holds, is freed when its last search lets go.
+struct LibrarySnapshot
+{
+    int minSearchLength;
+    GenomeList genomes;
+    //every distinct genome name gets a dense id, in the order it was first added; searches add up
+    //their hits by id in flat arrays and only look the name up for the results
+    vector<int> nameIds;                        //the id of genomes[k]'s name
+    vector<shared_ptr<const string>> names;     //the name of each id (shared, so genomeName() stays good while more are added)
+    //A removed genome is only marked here and left out of every search; its shard still indexes it until
+    //the shard is rebuilt without it, after which its bases are released.
+    vector<char> removed;
+    int removedCount;
+    //the index is a federation of shards, each covering some of the genomes; a search asks them all
+    vector<shared_ptr<const GenomeIndex>> shards;
+};
+
 class GenomeMatcherImpl
 {
-public:
-    GenomeMatcherImpl(int minSearchLength);
-    void addGenome(const Genome& genome);
-    int minimumSearchLength() const;
-    bool findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches) const;
-    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results) const;
-private:
-    int m_minSearchLength;
-    vector<Genome> genomes;
-    Trie<pair<int,int>> trie;   //the pair is <name_index,position_index>
-    //helper function of findGenomesWithThisDNA
-    int findHelper(Genome gen,bool exactMatchOnly,int pos,const string& fragment) const
-    {
-        string previousFragment;
-        gen.extract(pos, m_minSearchLength, previousFragment);
-        //if the previousFragment are already a snip
-        if (previousFragment!=fragment.substr(0,m_minSearchLength))
-            exactMatchOnly=true;
-        int i=m_minSearchLength;
-        string thisChar;
-        for (;i<fragment.length() && i+pos< gen.length();i++)
+public:
+    GenomeMatcherImpl(int minSearchLength, const GenomeMatcherOptions& options);
+    void addGenome(const Genome& genome);
+    void addGenomes(const vector<Genome>& newGenomes);
+    void addGenomesFromFiles(const vector<string>& filenames, vector<int>& genomesLoaded);
+    bool removeGenome(const string& name);
+    bool replaceGenome(const Genome& genome);
+    void compact();
+    int minimumSearchLength() const;
+    int genomeCount() const;
+    const string& genomeName(int genomeId) const;
+    bool findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches) const;
+    bool findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatchId>& matches) const;
+    bool findGenomesWithThisDNA(const vector<string>& fragments, int minimumLength, bool exactMatchOnly, vector<vector<DNAMatch>>& matches) const;
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results, const RelatedGenomesOptions& options) const;
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatchId>& results, const RelatedGenomesOptions& options) const;
+    bool save(const string& filename) const;
+    bool load(const string& filename);
+    void memoryUsage(MemoryUsage& usage) const;
+private:
+    typedef shared_ptr<const LibrarySnapshot> Snapshot;
+    //the settings new shards are built with; load() may change them, with m_writeMutex held
+    int m_minSearchLength;
+    GenomeMatcherOptions m_options;
+    unordered_map<string,int> m_nameLookup; //genome name to id, only used while adding
+    //only ever read and replaced through atomic_load()/atomic_store(), see current() and publish()
+    Snapshot m_snapshot;
+    unique_ptr<ThreadPool> m_pool;   //only when options.queryThreads asks for more than one thread
+    //Searches take no lock at all. m_writeMutex keeps changes (and compaction) one at a time; each builds
+    //its new version of the library with only that held and publishes it when it is complete.
+    mutable mutex m_writeMutex;
+    //the version of the library a search should use from start to finish
+    Snapshot current() const
+    {
+        return atomic_load(&m_snapshot);
+    }
+    //a copy of the current version for a change to edit, with m_writeMutex held
+    shared_ptr<LibrarySnapshot> edit() const
+    {
+        return make_shared<LibrarySnapshot>(*current());
+    }
+    //make next the version every search from now on sees, with m_writeMutex held
+    void publish(const shared_ptr<LibrarySnapshot>& next)
+    {
+        atomic_store(&m_snapshot, Snapshot(next));
+    }
+    //start over with an empty library
+    void clear();
+    //append a genome to next's genomes, giving its name an id in nameLookup if it is new
+    static void addToLibrary(LibrarySnapshot& next, unordered_map<string,int>& nameLookup, const Genome& genome);
+    //a new, empty shard of the engine in options, for minSearchLength
+    GenomeIndex* newShard(int minSearchLength, const GenomeMatcherOptions& options) const;
+    //a prepared shard of the genomes ids of library
+    shared_ptr<const GenomeIndex> buildShard(const LibrarySnapshot& library, const vector<int>& ids);
+    //the bases shard indexes in library, and how many of them belong to removed genomes
+    static long long shardBases(const LibrarySnapshot& library, const GenomeIndex& shard, long long& removedBases);
+    //next's genome id is no longer indexed by any of its shards: keep its name but drop its bases
+    static void release(LibrarySnapshot& next, int id);
+    //the number of threads the bulk loaders run on
+    int buildThreads() const;
+    //buffers one thread reuses from one batch of fragments to the next
+    struct BatchScratch
+    {
+        vector<int> order;
+        vector<vector<IndexHit>> hits;
+        vector<int> best;
+        //findRelatedGenomes' fragments of the batch, and what each of them matched
+        vector<string> fragments;
+        vector<vector<DNAMatchId>> matches;
+    };
+    //fragments are searched this many at a time, each batch by one thread
+    static const int BATCH_SIZE=1024;
+    //search fragments[first..last) of library as one batch, replacing matches[first..last); genomes with
+    //(*skip)[id] set may be left out
+    void findBatch(const LibrarySnapshot& library, const vector<string>& fragments, int first, int last, int minimumLength, bool exactMatchOnly, const vector<char>* skip, BatchScratch& scratch, vector<vector<DNAMatchId>>& matches) const;
+    //search windows [first..last) of the query (see GenomeIndex::findWindows) as one batch, like findBatch
+    //but replacing matches[0..last-first)
+    void findWindowBatch(const LibrarySnapshot& library, const string& text, const PackedSequence& query, int first, int last, int windowLength, int stride, bool exactMatchOnly, const vector<char>* skip, BatchScratch& scratch, vector<vector<DNAMatchId>>& matches) const;
+    //mark the genomes findRelatedGenomes can stop scoring from the counts per id, remaining fragments from the end
+    void settleGenomes(const LibrarySnapshot& library, const vector<int>& counts, int S, int remaining, double matchPercentThreshold, const RelatedGenomesOptions& options, vector<char>& skip) const;
+    //keep the best hit per genome id (the longest, then the earliest) and append those to matches
+    bool bestPerGenome(const LibrarySnapshot& library, const vector<IndexHit>& hits, vector<int>& best, vector<DNAMatchId>& matches) const;
+    //append found to matches with the ids turned into names
+    void appendNamed(const LibrarySnapshot& library, const vector<DNAMatchId>& found, vector<DNAMatch>& matches) const;
+    //the searches themselves, all against the one version of the library
+    bool searchFragment(const LibrarySnapshot& library, const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatchId>& matches) const;
+    bool scoreRelated(const LibrarySnapshot& library, const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatchId>& results, const RelatedGenomesOptions& options) const;
+    //add one genome to next in a shard of its own, merging it with the small shards added before it
+    void appendGenome(LibrarySnapshot& next, const Genome& genome);
+    //take the shards off the end of next while the last one indexes no more than twice what each of the
+    //shards (at most pieces of them) that ids is to be built into will, putting their live genomes in front
+    //of ids and adding their bases to bases, for the caller to rebuild along with ids
+    static void takeSmallShards(LibrarySnapshot& next, int pieces, vector<int>& ids, long long& bases);
+    //mark every live genome of next called name removed
+    bool markRemoved(LibrarySnapshot& next, const string& name);
+    //queue a background compaction if a shard has reached options.compactionThreshold, with m_writeMutex held
+    void scheduleCompaction();
+    //rebuild every shard whose removed genomes hold at least threshold of its bases
+    void compactShards(double threshold);
+    atomic<bool> m_compactionQueued;
+    unique_ptr<ThreadPool> m_compactor;   //one thread, made on the first compaction; last so it is joined first
+    /*
+    bool compareTwoGenomeMatch(const GenomeMatch& GM1, const GenomeMatch& GM2)
+    {
+        if (GM1.percentMatch>GM2.percentMatch)
+            return true;
+        if (GM1.percentMatch<GM2.percentMatch)
+            return false;
+        return (GM1.genomeName<GM2.genomeName);
+    }
+    bool compare(const GenomeMatch* GM1, const GenomeMatch* GM2)
+    {
+        return compareTwoGenomeMatch(*GM1, *GM2);
+    }
+     */
+};
+
+//set up
+GenomeMatcherImpl::GenomeMatcherImpl(int minSearchLength, const GenomeMatcherOptions& options)
+{
+    m_minSearchLength=minSearchLength;
+    m_options=options;
+    //a window can't be longer than the matches it has to find
+    m_options.minimizerWindow=max(1, min(options.minimizerWindow, minSearchLength));
+    m_compactionQueued=false;
+    //the calling thread works too, so the pool needs one thread fewer
+    int queryThreads=(options.queryThreads>0) ? options.queryThreads : ThreadPool::hardwareThreads();
+    if (queryThreads>1)
+        m_pool.reset(new ThreadPool(queryThreads-1));
+    clear();
+}
+
+void GenomeMatcherImpl::clear()
+{
+    m_nameLookup.clear();
+    shared_ptr<LibrarySnapshot> empty=make_shared<LibrarySnapshot>();
+    empty->minSearchLength=m_minSearchLength;
+    empty->removedCount=0;
+    publish(empty);
+}
+
+void GenomeMatcherImpl::addToLibrary(LibrarySnapshot& next, unordered_map<string,int>& nameLookup, const Genome& genome)
+{
+    next.genomes.push_back(make_shared<const Genome>(genome));
+    next.removed.push_back(0);
+    auto inserted=nameLookup.insert(make_pair(genome.name(), static_cast<int>(next.names.size())));
+    if (inserted.second)
+        next.names.push_back(make_shared<const string>(genome.name()));
+    next.nameIds.push_back(inserted.first->second);
+}
+
+GenomeIndex* GenomeMatcherImpl::newShard(int minSearchLength, const GenomeMatcherOptions& options) const
+{
+    if (options.engine==IndexEngine::SuffixArray)
+        return new SuffixArrayIndex;
+    int window=options.minimizerWindow;
+    //a key longer than 32 bases doesn't fit in 64 bits, fall back to the trie
+    if (options.engine==IndexEngine::KmerHash && minSearchLength-window+1<=KmerTable::MAX_K)
+    {
+        //every build thread may be filling a shard at once, so each gets an even share of the budget
+        size_t budget=static_cast<size_t>(max(options.memoryBudget, 0LL)/buildThreads());
+        return new KmerIndex(minSearchLength, window, budget, options.spillDirectory);
+    }
+    return newTrieIndex(minSearchLength, window);
+}
+
+shared_ptr<const GenomeIndex> GenomeMatcherImpl::buildShard(const LibrarySnapshot& library, const vector<int>& ids)
+{
+    shared_ptr<GenomeIndex> shard(newShard(m_minSearchLength, m_options));
+    for (size_t k=0;k<ids.size();k++)
+        shard->addGenome(ids[k], library.genomes[ids[k]]);
+    shard->prepare();
+    return shard;
+}
+
+long long GenomeMatcherImpl::shardBases(const LibrarySnapshot& library, const GenomeIndex& shard, long long& removedBases)
+{
+    long long total=0;
+    removedBases=0;
+    const vector<int>& ids=shard.genomeIds();
+    for (size_t k=0;k<ids.size();k++)
+    {
+        total+=library.genomes[ids[k]]->length();
+        if (library.removed[ids[k]])
+            removedBases+=library.genomes[ids[k]]->length();
+    }
+    return total;
+}
+
+void GenomeMatcherImpl::release(LibrarySnapshot& next, int id)
+{
+    //older snapshots, and the shards in them, keep the bases they hold for as long as they need them
+    next.genomes[id]=make_shared<const Genome>(next.genomes[id]->name(), string());
+}
+
+int GenomeMatcherImpl::buildThreads() const
+{
+    if (m_options.buildThreads>0)
+        return m_options.buildThreads;
+    return ThreadPool::hardwareThreads();
+}
+
+//used to add a new genome to the library of genomes maintained by your GenomeMatcher object.
+void GenomeMatcherImpl::addGenome(const Genome& genome)
+{
+    lock_guard<mutex> writing(m_writeMutex);
+    shared_ptr<LibrarySnapshot> next=edit();
+    appendGenome(*next, genome);
+    publish(next);
+}
+
+//A published shard can't grow, so the genome gets a new one. While the last shard is no more than twice the
+//size of the new one they are rebuilt as one, so adding genomes one at a time leaves a few shards of
+//doubling sizes (each base is rebuilt a logarithmic number of times) rather than one per genome.
+void GenomeMatcherImpl::appendGenome(LibrarySnapshot& next, const Genome& genome)
+{
+    addToLibrary(next, m_nameLookup, genome);
+    vector<int> ids(1, static_cast<int>(next.genomes.size()-1));
+    long long bases=genome.length();
+    takeSmallShards(next, 1, ids, bases);
+    next.shards.push_back(buildShard(next, ids));
+}
+
+void GenomeMatcherImpl::takeSmallShards(LibrarySnapshot& next, int pieces, vector<int>& ids, long long& bases)
+{
+    while (!next.shards.empty())
+    {
+        long long removedBases;
+        long long total=shardBases(next, *next.shards.back(), removedBases);
+        if (total-removedBases>2*bases/min(pieces, static_cast<int>(ids.size())))
+            break;
+        //the removed genomes are left behind, and with nothing indexing them their bases can go
+        const vector<int>& merged=next.shards.back()->genomeIds();
+        vector<int> live;
+        for (size_t k=0;k<merged.size();k++)
         {
-            gen.extract(i+pos, 1, thisChar);
-            //if the current character does not equal fragment’s corresponding character
-            if (thisChar!=fragment.substr(i,1))
-            {
-                if (exactMatchOnly)
-                    return i;
-                exactMatchOnly=true;//give it a chance
-            }
+            if (next.removed[merged[k]])
+                release(next, merged[k]);
+            else
+                live.push_back(merged[k]);
         }
-        return i;
+        ids.insert(ids.begin(), live.begin(), live.end());
+        bases+=total-removedBases;
+        next.shards.pop_back();
     }
-    /*
-    bool compareTwoGenomeMatch(const GenomeMatch& GM1, const GenomeMatch& GM2)
+}
+
+bool GenomeMatcherImpl::markRemoved(LibrarySnapshot& next, const string& name)
+{
+    auto search=m_nameLookup.find(name);
+    if (search==m_nameLookup.end())
+        return false;
+    bool removed=false;
+    for (size_t g=0;g<next.genomes.size();g++)
     {
-        if (GM1.percentMatch>GM2.percentMatch)
-            return true;
-        if (GM1.percentMatch<GM2.percentMatch)
-            return false;
-        return (GM1.genomeName<GM2.genomeName);
+        if (next.nameIds[g]==search->second && !next.removed[g])
+        {
+            next.removed[g]=1;
+            next.removedCount++;
+            removed=true;
+        }
     }
-    bool compare(const GenomeMatch* GM1, const GenomeMatch* GM2)
+    return removed;
+}
+
+//Removing only marks the genome, so it takes no longer than a scan of the library.
+bool GenomeMatcherImpl::removeGenome(const string& name)
+{
+    lock_guard<mutex> writing(m_writeMutex);
+    shared_ptr<LibrarySnapshot> next=edit();
+    if (!markRemoved(*next, name))
+        return false;
+    publish(next);
+    scheduleCompaction();
+    return true;
+}
+
+//The old genome goes and the new one comes in one version of the library, so no search sees neither (or both).
+bool GenomeMatcherImpl::replaceGenome(const Genome& genome)
+{
+    lock_guard<mutex> writing(m_writeMutex);
+    shared_ptr<LibrarySnapshot> next=edit();
+    bool replaced=markRemoved(*next, genome.name());
+    appendGenome(*next, genome);
+    publish(next);
+    if (replaced)
+        scheduleCompaction();
+    return replaced;
+}
+
+void GenomeMatcherImpl::compact()
+{
+    compactShards(0);
+}
+
+void GenomeMatcherImpl::scheduleCompaction()
+{
+    if (m_compactionQueued)
+        return;
+    Snapshot library=current();
+    bool due=false;
+    for (size_t s=0;s<library->shards.size() && !due;s++)
     {
-        return compareTwoGenomeMatch(*GM1, *GM2);
+        long long removed;
+        long long total=shardBases(*library, *library->shards[s], removed);
+        due=removed>0 && removed>=m_options.compactionThreshold*total;
     }
-     */
-};
+    if (!due)
+        return;
+    if (!m_compactor)
+        m_compactor.reset(new ThreadPool(1));
+    m_compactionQueued=true;
+    m_compactor->submit([this]() { compactShards(m_options.compactionThreshold); });
+}
 
-//set up
-GenomeMatcherImpl::GenomeMatcherImpl(int minSearchLength)
+//The new shards are built from the live genomes into a new version of the library, so searches carry on
+//against the old one meanwhile; the removed genomes' bases are released in the new version.
+void GenomeMatcherImpl::compactShards(double threshold)
 {
-    m_minSearchLength=minSearchLength;
+    lock_guard<mutex> writing(m_writeMutex);
+    m_compactionQueued=false;
+    shared_ptr<LibrarySnapshot> next=edit();
+    vector<shared_ptr<const GenomeIndex>> kept;
+    bool changed=false;
+    for (size_t s=0;s<next->shards.size();s++)
+    {
+        long long removed;
+        long long total=shardBases(*next, *next->shards[s], removed);
+        if (removed==0 || removed<threshold*total)
+        {
+            kept.push_back(next->shards[s]);
+            continue;
+        }
+        const vector<int>& ids=next->shards[s]->genomeIds();
+        vector<int> live;
+        for (size_t k=0;k<ids.size();k++)
+        {
+            if (next->removed[ids[k]])
+                release(*next, ids[k]);
+            else
+                live.push_back(ids[k]);
+        }
+        //a shard left with nothing is just dropped
+        if (!live.empty())
+            kept.push_back(buildShard(*next, live));
+        changed=true;
+    }
+    if (!changed)
+        return;
+    next->shards=move(kept);
+    publish(next);
 }
 
-//used to add a new genome to the library of genomes maintained by your GenomeMatcher object.
-void GenomeMatcherImpl::addGenome(const Genome& genome)
+//The small shards at the end join the batch as appendGenome() has them join a genome, each of the batch's
+//shards standing in for the one new shard there, so batch after batch doesn't pile up shards. Then split it
+//all into one run of consecutive genomes per build thread, with about the same number of bases in each, and
+//build every run into its own shard at the same time.
+void GenomeMatcherImpl::addGenomes(const vector<Genome>& newGenomes)
 {
-    genomes.push_back(genome);
-    string fragment;
-    for (int i=0;genome.extract(i, m_minSearchLength, fragment);i++)
+    if (newGenomes.empty())
+        return;
+    lock_guard<mutex> writing(m_writeMutex);
+    shared_ptr<LibrarySnapshot> next=edit();
+    vector<int> ids;
+    long long totalBases=0;
+    for (size_t k=0;k<newGenomes.size();k++)
     {
-        //the pair is <name_index,position_index>
-        trie.insert(fragment,make_pair(static_cast<int>(genomes.size()-1), i));
+        addToLibrary(*next, m_nameLookup, newGenomes[k]);
+        ids.push_back(static_cast<int>(next->genomes.size()-1));
+        totalBases+=newGenomes[k].length();
     }
+    takeSmallShards(*next, buildThreads(), ids, totalBases);
+    int shardCount=min(buildThreads(), static_cast<int>(ids.size()));
+    //bounds[s] is where the ids of shard s start
+    vector<size_t> bounds(1, 0);
+    long long bases=0;
+    for (size_t k=0;k<ids.size();k++)
+    {
+        bases+=next->genomes[ids[k]]->length();
+        if (static_cast<int>(bounds.size())<shardCount && k+1<ids.size() && bases*shardCount>=totalBases*static_cast<long long>(bounds.size()))
+            bounds.push_back(k+1);
+    }
+    bounds.push_back(ids.size());
+    vector<shared_ptr<const GenomeIndex>> built(bounds.size()-1);
+    //nothing sees the new version until it is published, so the shards are built into it unlocked
+    ThreadPool pool(static_cast<int>(built.size())-1);
+    pool.parallelFor(static_cast<int>(built.size()), [&](int s, int)
+    {
+        built[s]=buildShard(*next, vector<int>(ids.begin()+bounds[s], ids.begin()+bounds[s+1]));
+    });
+    next->shards.insert(next->shards.end(), built.begin(), built.end());
+    publish(next);
+}
+
+//Parse every file at once, then add the genomes in file order with addGenomes().
+void GenomeMatcherImpl::addGenomesFromFiles(const vector<string>& filenames, vector<int>& genomesLoaded)
+{
+    vector<vector<Genome>> parsed(filenames.size());
+    genomesLoaded.assign(filenames.size(), -1);
+    ThreadPool pool(min(buildThreads(), static_cast<int>(filenames.size()))-1);
+    pool.parallelFor(static_cast<int>(filenames.size()), [&](int k, int)
+    {
+        ifstream inputf(filenames[k]);
+        if (inputf && Genome::load(inputf, parsed[k]))
+            genomesLoaded[k]=static_cast<int>(parsed[k].size());
+        else
+            parsed[k].clear();
+    });
+    vector<Genome> all;
+    for (size_t k=0;k<parsed.size();k++)
+        all.insert(all.end(), parsed[k].begin(), parsed[k].end());
+    addGenomes(all);
 }
 
 //get minimum search length
 int GenomeMatcherImpl::minimumSearchLength() const
 {
-    return m_minSearchLength;
+    return current()->minSearchLength;
+}
+
+int GenomeMatcherImpl::genomeCount() const
+{
+    return static_cast<int>(current()->names.size());
+}
+
+//every later version of the library shares the name, so it lasts until load() replaces the library
+const string& GenomeMatcherImpl::genomeName(int genomeId) const
+{
+    return *current()->names[genomeId];
 }
 
 //ued to find all genomes in the library that contain a specified DNA fragment (e.g., “GATTACA”), or potentially one or more of its SNiPs (e.g. “GCTTACA”, “GATTATA”), which are minimumLength or more bases long.
-bool GenomeMatcherImpl::findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches) const
+bool GenomeMatcherImpl::findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatchId>& matches) const
 {
-    std::vector<pair<int,int>> searchResult;
-    unordered_map<std::string,pair<int,int>> tempMatches;
-    bool found=false;
+    return searchFragment(*current(), fragment, minimumLength, exactMatchOnly, matches);
+}
+
+bool GenomeMatcherImpl::searchFragment(const LibrarySnapshot& library, const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatchId>& matches) const
+{
+    std::vector<IndexHit> hits;
+    vector<int> best;
     /*
      The findGenomesWIthThisDNA() method must return false if
         1. fragment's length is less than minimumLength, or
@@ -96,45 +1491,145 @@ bool GenomeMatcherImpl::findGenomesWithThisDNA(const string& fragment, int minim
      */
     if (fragment.length()<minimumLength)
         return false;
-    if (minimumLength<minimumSearchLength())
+    if (minimumLength<library.minSearchLength)
         return false;
-    searchResult=trie.find(fragment.substr(0,m_minSearchLength), exactMatchOnly);
-    int totalLength;
-    for (size_t k=0;k<searchResult.size();k++)
+    for (size_t s=0;s<library.shards.size();s++)
+        library.shards[s]->findMatches(fragment, minimumLength, exactMatchOnly, hits);
+    return bestPerGenome(library, hits, best, matches);
+}
+
+//the id search, with the names looked up at the end
+bool GenomeMatcherImpl::findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches) const
+{
+    Snapshot library=current();
+    vector<DNAMatchId> found;
+    bool result=searchFragment(*library, fragment, minimumLength, exactMatchOnly, found);
+    appendNamed(*library, found, matches);
+    return result;
+}
+
+void GenomeMatcherImpl::appendNamed(const LibrarySnapshot& library, const vector<DNAMatchId>& found, vector<DNAMatch>& matches) const
+{
+    for (size_t k=0;k<found.size();k++)
+    {
+        DNAMatch thisDNA;
+        thisDNA.genomeName=*library.names[found[k].genomeId];
+        thisDNA.length=found[k].length;
+        thisDNA.position=found[k].position;
+        matches.push_back(thisDNA);
+    }
+}
+
+//best[id] is where genome id's match is in matches, or -1 if it has none yet; every entry is -1 again on return
+bool GenomeMatcherImpl::bestPerGenome(const LibrarySnapshot& library, const vector<IndexHit>& hits, vector<int>& best, vector<DNAMatchId>& matches) const
+{
+    GEENOMICS_TIME(aggregationNanos);
+    if (best.size()<library.names.size())
+        best.resize(library.names.size(), -1);
+    size_t first=matches.size();
+    for (size_t k=0;k<hits.size();k++)
     {
-        //use findHelper to get the total length with current search result’s genome’s name index
-        totalLength=findHelper(genomes[searchResult[k].first],exactMatchOnly,searchResult[k].second,fragment);
-        if (totalLength<minimumLength)
+        //a removed genome's shard may still have it
+        if (library.removed[hits[k].genomeId])
             continue;
-        //check if such search result’s genome’s name is already in the tempMatches
-        auto search=tempMatches.find(genomes[searchResult[k].first].name());
-        //if so, update the tempMatches with the longer total length
-        if (search != tempMatches.end())
+        int id=library.nameIds[hits[k].genomeId];
+        int totalLength=hits[k].length;
+        //if not seen yet, add the new search result's genome id and total length and position
+        if (best[id]<0)
         {
-            if (search->second.first<totalLength)
-            {
-                search->second.first=totalLength;
-                search->second.second=searchResult[k].second;
-            }
+            best[id]=static_cast<int>(matches.size());
+            matches.push_back(DNAMatchId{id, totalLength, hits[k].position});
             continue;
         }
-        //if not, insert the new search result’s genome name and total length and position to the tempMatches
-        tempMatches.insert(make_pair(genomes[searchResult[k].first].name(), make_pair(totalLength,searchResult[k].second)));
-        found=true;
+        //if so, update it with the longer total length (or the earlier position of the same length)
+        DNAMatchId& match=matches[best[id]];
+        if (match.length<totalLength || (match.length==totalLength && hits[k].position<match.position))
+        {
+            match.length=totalLength;
+            match.position=hits[k].position;
+        }
     }
-    if (!found)
+    //the matches just added are the only entries that were touched
+    for (size_t k=first;k<matches.size();k++)
+        best[matches[k].genomeId]=-1;
+    return matches.size()>first;
+}
+
+//Sort the batch by seed so fragments that share one are searched together, let every shard run the
+//whole batch, then boil each fragment's hits down to one match per genome.
+void GenomeMatcherImpl::findBatch(const LibrarySnapshot& library, const vector<string>& fragments, int first, int last, int minimumLength, bool exactMatchOnly, const vector<char>* skip, BatchScratch& scratch, vector<vector<DNAMatchId>>& matches) const
+{
+    //everything in scratch is indexed from first
+    const string* batch=fragments.data()+first;
+    scratch.order.clear();
+    if (scratch.hits.size()<static_cast<size_t>(last-first))
+        scratch.hits.resize(last-first);
+    for (int k=0;k<last-first;k++)
+    {
+        matches[first+k].clear();
+        scratch.hits[k].clear();
+        //too short to match, same as findGenomesWithThisDNA
+        if (batch[k].length()>=static_cast<size_t>(minimumLength))
+            scratch.order.push_back(k);
+    }
+    int seedLength=library.minSearchLength;
+    sort(scratch.order.begin(), scratch.order.end(), [batch, seedLength](int a, int b)
+    {
+        return string_view(batch[a]).substr(0,seedLength)<string_view(batch[b]).substr(0,seedLength);
+    });
+    for (size_t s=0;s<library.shards.size();s++)
+        library.shards[s]->findMatches(batch, scratch.order, minimumLength, exactMatchOnly, skip, scratch.hits);
+    for (size_t i=0;i<scratch.order.size();i++)
+        bestPerGenome(library, scratch.hits[scratch.order[i]], scratch.best, matches[first+scratch.order[i]]);
+}
+
+void GenomeMatcherImpl::findWindowBatch(const LibrarySnapshot& library, const string& text, const PackedSequence& query, int first, int last, int windowLength, int stride, bool exactMatchOnly, const vector<char>* skip, BatchScratch& scratch, vector<vector<DNAMatchId>>& matches) const
+{
+    if (scratch.hits.size()<static_cast<size_t>(last-first))
+        scratch.hits.resize(last-first);
+    for (int k=0;k<last-first;k++)
+    {
+        matches[k].clear();
+        scratch.hits[k].clear();
+    }
+    for (size_t s=0;s<library.shards.size();s++)
+        library.shards[s]->findWindows(text, query, windowLength, stride, first, last, exactMatchOnly, skip, scratch.hits);
+    for (int k=0;k<last-first;k++)
+        bestPerGenome(library, scratch.hits[k], scratch.best, matches[k]);
+}
+
+//The batch form of findGenomesWithThisDNA: the fragments are split into batches that run on the query threads.
+bool GenomeMatcherImpl::findGenomesWithThisDNA(const vector<string>& fragments, int minimumLength, bool exactMatchOnly, vector<vector<DNAMatch>>& matches) const
+{
+    Snapshot library=current();
+    matches.resize(fragments.size());
+    for (size_t k=0;k<matches.size();k++)
+        matches[k].clear();
+    if (minimumLength<library->minSearchLength)
         return false;
-    //push back all the items in the unordered_map tempMatches to vector matches
-    unordered_map<std::string,pair<int,int>>:: iterator itr;
-    for (itr = tempMatches.begin(); itr != tempMatches.end(); itr++)
+    int count=static_cast<int>(fragments.size());
+    int batches=(count+BATCH_SIZE-1)/BATCH_SIZE;
+    vector<BatchScratch> scratch(m_pool ? min(m_pool->size()+1, batches) : 1);
+    vector<vector<DNAMatchId>> found(fragments.size());
+    auto runBatch=[&](int b, int slot)
     {
-        DNAMatch thisDNA;
-        thisDNA.genomeName=itr->first;
-        thisDNA.length=itr->second.first;
-        thisDNA.position=itr->second.second;
-        matches.push_back(thisDNA);
+        findBatch(*library, fragments, b*BATCH_SIZE, min(count, (b+1)*BATCH_SIZE), minimumLength, exactMatchOnly, library->removedCount>0 ? &library->removed : nullptr, scratch[slot], found);
+    };
+    if (m_pool)
+        m_pool->parallelFor(batches, runBatch, static_cast<int>(scratch.size())-1);
+    else
+    {
+        for (int b=0;b<batches;b++)
+            runBatch(b, 0);
     }
-    return true;
+    bool any=false;
+    for (size_t k=0;k<found.size();k++)
+    {
+        appendNamed(*library, found[k], matches[k]);
+        if (!found[k].empty())
+            any=true;
+    }
+    return any;
 }
 /*
 bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results) const
@@ -194,77 +1689,279 @@ bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatc
 
 
 //The findRelatedGenomes() method compares a passed-in query genome for a new organism against all genomes currently held in a GenomeMatcher object’s library and passes back a vector of all genomes that contain more than matchPercentThreshold of the base sequences of length fragmentMatchLength from the query genome.
-bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results) const
+bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatchId>& results, const RelatedGenomesOptions& options) const
 {
-    if (fragmentMatchLength<minimumSearchLength())
+    return scoreRelated(*current(), query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results, options);
+}
+
+bool GenomeMatcherImpl::scoreRelated(const LibrarySnapshot& library, const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatchId>& results, const RelatedGenomesOptions& options) const
+{
+    if (fragmentMatchLength<library.minSearchLength)
         return false;
-    bool found=false;
+    //With a stride other than fragmentMatchLength the fragments are windows every stride bases, searched
+    //straight from the query; each batch is a run of consecutive windows, so they can share seed lookups.
+    int stride=(options.stride>0) ? options.stride : fragmentMatchLength;
+    bool sliding=(stride!=fragmentMatchLength);
     int S=query.length()/fragmentMatchLength;
-    unordered_map<std::string,double> totalMatches;
-    for (int i=0;i<S;i++)
+    if (sliding)
+        S=(query.length()>=fragmentMatchLength) ? (query.length()-fragmentMatchLength)/stride+1 : 0;
+    string text;
+    if (sliding)
+        query.extract(0, query.length(), text);
+    int batches=(S+BATCH_SIZE-1)/BATCH_SIZE;
+    //how many fragments matched each genome id; every thread counts into its own array, summed after each round
+    int ids=static_cast<int>(library.names.size());
+    int slots=m_pool ? min(m_pool->size()+1, max(batches, 1)) : 1;
+    vector<vector<int>> partialMatches(slots, vector<int>(ids));
+    vector<BatchScratch> scratch(slots);
+    //genomes that are settled one way or the other and needn't be scored any more, starting with the removed ones
+    bool pruning=options.pruneHopeless || options.stopAtThreshold;
+    bool skipping=pruning || library.removedCount>0;
+    vector<char> skip;
+    if (skipping)
+        skip=library.removed;
+    auto scoreBatch=[&](int b, int slot)
     {
-        string partSequence;
-        //Extract that sequence from the queried genome.
-        query.extract(i*fragmentMatchLength, fragmentMatchLength, partSequence);
-        vector<DNAMatch> currentMatches;
-        //Search for the extracted sequence across all genomes in the library (using findGenomesWithThisDNA())
-        findGenomesWithThisDNA(partSequence, fragmentMatchLength, exactMatchOnly, currentMatches);
+        int first=b*BATCH_SIZE, last=min(S, (b+1)*BATCH_SIZE);
+        //only this batch's fragments and matches are held at once, in buffers the thread reuses
+        BatchScratch& mine=scratch[slot];
+        if (mine.matches.size()<static_cast<size_t>(last-first))
+            mine.matches.resize(last-first);
+        if (sliding)
+            findWindowBatch(library, text, query.sequence(), first, last, fragmentMatchLength, stride, exactMatchOnly, skipping ? &skip : nullptr, mine, mine.matches);
+        else
+        {
+            //Extract the batch's fragments from the queried genome and search them across all genomes in the library
+            if (mine.fragments.size()<static_cast<size_t>(last-first))
+                mine.fragments.resize(last-first);
+            for (int i=first;i<last;i++)
+                query.extract(i*fragmentMatchLength, fragmentMatchLength, mine.fragments[i-first]);
+            findBatch(library, mine.fragments, 0, last-first, fragmentMatchLength, exactMatchOnly, skipping ? &skip : nullptr, mine, mine.matches);
+        }
         //If a match is found in one or more genomes in the library, then for each such genome, increase the count of matches found thus far for it.
-        for (size_t k=0;k<currentMatches.size();k++)
+        for (int i=0;i<last-first;i++)
         {
-            found=true;
-            bool addNew=true;
-            for (size_t j=0;j<totalMatches.size();j++)
+            for (size_t k=0;k<mine.matches[i].size();k++)
+                partialMatches[slot][mine.matches[i][k].genomeId]++;
+        }
+    };
+    //Without pruning every batch runs in one round. With it a round is one batch per thread, and
+    //between rounds the counts so far decide which genomes to stop scoring.
+    vector<int> totalMatches(ids);
+    int roundSize=pruning ? slots : max(batches, 1);
+    for (int round=0;round<batches;round+=roundSize)
+    {
+        int count=min(roundSize, batches-round);
+        if (m_pool)
+            m_pool->parallelFor(count, [&](int b, int slot) { scoreBatch(round+b, slot); }, slots-1);
+        else
+        {
+            for (int b=0;b<count;b++)
+                scoreBatch(round+b, 0);
+        }
+        for (size_t slot=0;slot<partialMatches.size();slot++)
+        {
+            for (int id=0;id<ids;id++)
             {
-                auto search = totalMatches.find(currentMatches[k].genomeName);
-                if (search != totalMatches.end())
-                {
-                    search->second+=100.00/S;
-                    addNew=false;
-                    break;
-                }
+                totalMatches[id]+=partialMatches[slot][id];
+                partialMatches[slot][id]=0;
             }
-            if (!addNew)
-                continue;
-            totalMatches.insert(make_pair(currentMatches[k].genomeName, 100.00/S));
         }
+        if (pruning)
+            settleGenomes(library, totalMatches, S, S-min(S, (round+count)*BATCH_SIZE), matchPercentThreshold, options, skip);
     }
-    if (!found)
-        return false;
-    //push back all totalmatches to results
-    unordered_map<std::string, double>:: iterator itr;
-    for (itr = totalMatches.begin(); itr != totalMatches.end(); itr++)
+    bool found=false;
+    //push back every genome that cleared the threshold to results
+    //(the percentage comes from the count in one step, so it can't depend on the order matches were added up)
+    size_t before=results.size();
+    for (int id=0;id<ids;id++)
     {
-        if (itr->second>=matchPercentThreshold)
-        {
-            GenomeMatch thisGenomeMatch;
-            thisGenomeMatch.genomeName=itr->first;
-            thisGenomeMatch.percentMatch=itr->second;
-            results.push_back(thisGenomeMatch);
-        }
+        if (totalMatches[id]==0)
+            continue;
+        found=true;
+        double percentMatch=totalMatches[id]*100.00/S;
+        if (percentMatch>=matchPercentThreshold)
+            results.push_back(GenomeMatchId{id, percentMatch});
     }
+    if (!found)
+        return false;
     //ordered in descending order by the match proportion p, and breaking ties by the genome name in ascending alphabetical order.
-    sort(results.begin(),
+    sort(results.begin()+before,
          results.end(),
-         [](const GenomeMatch& lhs, const GenomeMatch& rhs)
+         [&library](const GenomeMatchId& lhs, const GenomeMatchId& rhs)
          {
              if (lhs.percentMatch>rhs.percentMatch)
                  return true;
              if (lhs.percentMatch<rhs.percentMatch)
                  return false;
-             return (lhs.genomeName<rhs.genomeName);
+             return (*library.names[lhs.genomeId]<*library.names[rhs.genomeId]);
          });
+    if (options.topK>0 && results.size()-before>static_cast<size_t>(options.topK))
+        results.resize(before+options.topK);
+    //a pruned genome may have matched a few fragments before it was dropped, so only the results count
+    if (pruning)
+        return results.size()>before;
     return found;
 }
 
+//the id search, with the names looked up at the end
+bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results, const RelatedGenomesOptions& options) const
+{
+    Snapshot library=current();
+    vector<GenomeMatchId> found;
+    bool result=scoreRelated(*library, query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, found, options);
+    for (size_t k=0;k<found.size();k++)
+    {
+        GenomeMatch thisGenomeMatch;
+        thisGenomeMatch.genomeName=*library->names[found[k].genomeId];
+        thisGenomeMatch.percentMatch=found[k].percentMatch;
+        results.push_back(thisGenomeMatch);
+    }
+    return result;
+}
+
+//Mark the genomes not worth scoring any more: with stopAtThreshold the ones that have cleared the threshold,
+//with pruneHopeless the ones that couldn't reach it, or the top k, even if every remaining fragment matched them.
+void GenomeMatcherImpl::settleGenomes(const LibrarySnapshot& library, const vector<int>& counts, int S, int remaining, double matchPercentThreshold, const RelatedGenomesOptions& options, vector<char>& skip) const
+{
+    //the k-th best count so far among the genomes matched at all; a genome that can't reach it can't make the top k
+    int kth=0;
+    if (options.topK>0)
+    {
+        vector<int> best;
+        for (size_t id=0;id<counts.size();id++)
+        {
+            if (counts[id]>0)
+                best.push_back(counts[id]);
+        }
+        if (best.size()>=static_cast<size_t>(options.topK))
+        {
+            nth_element(best.begin(), best.begin()+(options.topK-1), best.end(), greater<int>());
+            kth=best[options.topK-1];
+        }
+    }
+    for (size_t g=0;g<library.genomes.size();g++)
+    {
+        int count=counts[library.nameIds[g]];
+        bool hopeless=(count+remaining)*100.00/S<matchPercentThreshold || count+remaining<kth;
+        bool cleared=count*100.00/S>=matchPercentThreshold;
+        skip[g]=library.removed[g] || (options.pruneHopeless && hopeless) || (options.stopAtThreshold && cleared);
+    }
+}
+
+//Every genome of the current version is counted, removed or not, since its bases stay until a compaction
+//releases them; so is each shard. Older versions still held by a search aren't.
+void GenomeMatcherImpl::memoryUsage(MemoryUsage& usage) const
+{
+    usage=MemoryUsage();
+    Snapshot library=current();
+    ByteCount genomes;
+    for (size_t g=0;g<library->genomes.size();g++)
+    {
+        library->genomes[g]->sequence().countBytes(genomes);
+        genomes.owned+=sizeof(Genome)+sizeof(PackedSequence)+library->genomes[g]->name().size();
+    }
+    for (size_t n=0;n<library->names.size();n++)
+        genomes.owned+=sizeof(string)+library->names[n]->capacity();
+    genomes.add(library->genomes);
+    genomes.add(library->nameIds);
+    genomes.add(library->names);
+    genomes.add(library->removed);
+    addBytes(genomes, usage.genomes, usage);
+    for (size_t s=0;s<library->shards.size();s++)
+        library->shards[s]->memoryUsage(usage);
+}
+
+//The saved library: a magic number and format version, the settings, every genome's name and packed
+//bases, which of them are removed, then the number of shards and each shard's own arrays. Everything is laid out so it can be used in place once mapped.
+static const char INDEX_MAGIC[8]={'G','E','E','N','O','M','I','X'};
+static const uint32_t INDEX_VERSION=8;
+
+bool GenomeMatcherImpl::save(const string& filename) const
+{
+    //the settings only change under m_writeMutex; the library is whichever version is current
+    lock_guard<mutex> writing(m_writeMutex);
+    Snapshot library=current();
+    IndexWriter writer(filename);
+    if (!writer.ok())
+        return false;
+    writer.write(INDEX_MAGIC);
+    writer.write(INDEX_VERSION);
+    writer.write(static_cast<int32_t>(library->minSearchLength));
+    writer.write(static_cast<int32_t>(m_options.engine));
+    writer.write(static_cast<int32_t>(m_options.minimizerWindow));
+    writer.write(static_cast<uint64_t>(library->genomes.size()));
+    for (size_t k=0;k<library->genomes.size();k++)
+    {
+        writer.writeString(library->genomes[k]->name());
+        library->genomes[k]->sequence().save(writer);
+    }
+    writer.writeArray(library->removed);
+    writer.write(static_cast<uint64_t>(library->shards.size()));
+    for (size_t s=0;s<library->shards.size();s++)
+        library->shards[s]->save(writer);
+    return writer.ok();
+}
+
+//The new library is read into a version of its own, with settings of its own, and only once every part of
+//it has been read are they taken on and the version published, in one step: searches see either the old
+//library or the whole new one, and a file that doesn't load leaves the old one just as it was.
+bool GenomeMatcherImpl::load(const string& filename)
+{
+    lock_guard<mutex> writing(m_writeMutex);
+    shared_ptr<MappedFile> file=MappedFile::open(filename);
+    if (!file)
+        return false;
+    IndexReader reader(file);
+    char magic[8];
+    uint32_t version;
+    int32_t minSearchLength, engine, window;
+    uint64_t count;
+    if (!reader.read(magic) || memcmp(magic, INDEX_MAGIC, sizeof(magic))!=0 || !reader.read(version) || version!=INDEX_VERSION
+        || !reader.read(minSearchLength) || !reader.read(engine) || !reader.read(window) || !reader.read(count)
+        || minSearchLength<1 || engine<static_cast<int32_t>(IndexEngine::Trie) || engine>static_cast<int32_t>(IndexEngine::KmerHash)
+        || window<1 || window>minSearchLength)
+        return false;
+    GenomeMatcherOptions options=m_options;
+    options.engine=static_cast<IndexEngine>(engine);
+    options.minimizerWindow=window;
+    unordered_map<string,int> nameLookup;
+    shared_ptr<LibrarySnapshot> next=make_shared<LibrarySnapshot>();
+    next->minSearchLength=minSearchLength;
+    for (uint64_t k=0;k<count;k++)
+    {
+        string name;
+        PackedSequence sequence;
+        if (!reader.readString(name) || !sequence.load(reader))
+            return false;
+        addToLibrary(*next, nameLookup, Genome(name, sequence));
+    }
+    uint64_t shards;
+    if (!reader.readArray(next->removed) || next->removed.size()!=next->genomes.size() || !reader.read(shards))
+        return false;
+    for (uint64_t s=0;s<shards;s++)
+    {
+        shared_ptr<GenomeIndex> shard(newShard(minSearchLength, options));
+        if (!shard->load(reader, next->genomes))
+            return false;
+        next->shards.push_back(shard);
+    }
+    next->removedCount=static_cast<int>(count_if(next->removed.begin(), next->removed.end(), [](char removed) { return removed!=0; }));
+    m_minSearchLength=minSearchLength;
+    m_options=options;
+    m_nameLookup.swap(nameLookup);
+    publish(next);
+    return true;
+}
+
 //******************** GenomeMatcher functions ********************************
 
 // These functions simply delegate to GenomeMatcherImpl's functions.
 // You probably don't want to change any of this code.
 
-GenomeMatcher::GenomeMatcher(int minSearchLength)
+GenomeMatcher::GenomeMatcher(int minSearchLength, const GenomeMatcherOptions& options)
 {
-    m_impl = new GenomeMatcherImpl(minSearchLength);
+    m_impl = new GenomeMatcherImpl(minSearchLength, options);
 }
 
 GenomeMatcher::~GenomeMatcher()
@@ -277,17 +1974,123 @@ void GenomeMatcher::addGenome(const Genome& genome)
     m_impl->addGenome(genome);
 }
 
+void GenomeMatcher::addGenomes(const vector<Genome>& genomes)
+{
+    m_impl->addGenomes(genomes);
+}
+
+void GenomeMatcher::addGenomesFromFiles(const vector<string>& filenames, vector<int>& genomesLoaded)
+{
+    m_impl->addGenomesFromFiles(filenames, genomesLoaded);
+}
+
+bool GenomeMatcher::removeGenome(const string& name)
+{
+    return m_impl->removeGenome(name);
+}
+
+bool GenomeMatcher::replaceGenome(const Genome& genome)
+{
+    return m_impl->replaceGenome(genome);
+}
+
+void GenomeMatcher::compact()
+{
+    m_impl->compact();
+}
+
 int GenomeMatcher::minimumSearchLength() const
 {
     return m_impl->minimumSearchLength();
 }
 
+int GenomeMatcher::genomeCount() const
+{
+    return m_impl->genomeCount();
+}
+
+const string& GenomeMatcher::genomeName(int genomeId) const
+{
+    return m_impl->genomeName(genomeId);
+}
+
 bool GenomeMatcher::findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches) const
 {
     return m_impl->findGenomesWithThisDNA(fragment, minimumLength, exactMatchOnly, matches);
 }
 
-bool GenomeMatcher::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results) const
+bool GenomeMatcher::findGenomesWithThisDNA(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatchId>& matches) const
+{
+    return m_impl->findGenomesWithThisDNA(fragment, minimumLength, exactMatchOnly, matches);
+}
+
+bool GenomeMatcher::findGenomesWithThisDNA(const vector<string>& fragments, int minimumLength, bool exactMatchOnly, vector<vector<DNAMatch>>& matches) const
+{
+    return m_impl->findGenomesWithThisDNA(fragments, minimumLength, exactMatchOnly, matches);
+}
+
+bool GenomeMatcher::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatch>& results, const RelatedGenomesOptions& options) const
+{
+    return m_impl->findRelatedGenomes(query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results, options);
+}
+
+bool GenomeMatcher::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, vector<GenomeMatchId>& results, const RelatedGenomesOptions& options) const
+{
+    return m_impl->findRelatedGenomes(query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results, options);
+}
+
+bool GenomeMatcher::save(const string& filename) const
+{
+    return m_impl->save(filename);
+}
+
+bool GenomeMatcher::load(const string& filename)
+{
+    return m_impl->load(filename);
+}
+
+void GenomeMatcher::memoryUsage(MemoryUsage& usage) const
+{
+    m_impl->memoryUsage(usage);
+}
+
+#ifdef GEENOMICS_STATS
+static void copyHistogram(const QueryHistogram& from, StatHistogram& to)
+{
+    to.buckets.resize(QueryHistogram::BUCKETS);
+    for (int b=0;b<QueryHistogram::BUCKETS;b++)
+        to.buckets[b]=from.buckets[b];
+    //drop the empty buckets at the top
+    while (!to.buckets.empty() && to.buckets.back()==0)
+        to.buckets.pop_back();
+    to.samples=from.samples;
+    to.total=from.total;
+}
+#endif
+
+void GenomeMatcher::statistics(MatcherStatistics& stats)
+{
+    stats=MatcherStatistics();
+#ifdef GEENOMICS_STATS
+    const QueryStats& counted=queryStats();
+    stats.enabled=true;
+    stats.fragments=counted.fragments;
+    stats.seedLookups=counted.seedLookups;
+    stats.trieNodesVisited=counted.trieNodesVisited;
+    stats.candidates=counted.candidates;
+    stats.candidatesRejected=counted.candidatesRejected;
+    stats.bufferBytes=counted.bufferBytes;
+    copyHistogram(counted.candidatesPerSeed, stats.candidatesPerSeed);
+    copyHistogram(counted.extensionLength, stats.extensionLength);
+    copyHistogram(counted.lookupNanos, stats.lookupNanos);
+    copyHistogram(counted.extensionNanos, stats.extensionNanos);
+    copyHistogram(counted.aggregationNanos, stats.aggregationNanos);
+#endif
+}
+
+void GenomeMatcher::resetStatistics()
 {
-    return m_impl->findRelatedGenomes(query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results);
+#ifdef GEENOMICS_STATS
+    queryStats().reset();
+#endif
 }
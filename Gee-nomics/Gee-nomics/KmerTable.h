@@ -0,0 +1,430 @@
+#ifndef KMERTABLE_INCLUDED
+#define KMERTABLE_INCLUDED
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <queue>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include "MappedStorage.h"
+#include "PostingStore.h"
+
+//A multimap from k-mers (k <= 32, 2 bits per base, first base in the highest bits) to int values.
+//Inserts collect in a pending list; build() sorts them in with what is already there, giving every
+//distinct k-mer one compressed posting list of its values (in increasing order). A table of buckets on the top bits
+//of the k-mer points straight at the few k-mers to search, so a lookup is O(1) on average.
+//
+//With a spill budget, whenever the pending inserts take more than that they are sorted into a run in a
+//SpillFile, and build() merges the runs into the table's arrays in files of their own, which the table then
+//maps like a loaded one. So building never holds much more than the budget in memory, and the pages of
+//the table itself are the kernel's to drop and read back. Should the disk fail, it all falls back to memory,
+//unless a run can't even be read back: then build() fails rather than leave out the values in it.
+class KmerTable
+{
+public:
+    static const int MAX_K=32;
+
+    explicit KmerTable(int k);
+    void reset();
+    //spill the pending inserts past budget bytes (at least MIN_SPILL) to a file in directory ("" for the
+    //default, see SpillFile); 0 keeps them all in memory
+    void setSpill(size_t budget, const std::string& directory);
+    //inserting invalidates the table until the next build()
+    void insert(uint64_t kmer, int value);
+    bool built() const;
+    //meant to be called once, after all the inserts (an index shard is built once and never grows);
+    //false if spilled inserts couldn't be read back, which leaves the table unbuilt
+    bool build();
+    int k() const;
+    //calls visit(value) for every value stored under kmer, the table must be built
+    template<typename Visitor>
+    void forEach(uint64_t kmer, Visitor visit) const;
+    //the memory accounting: the k-mers and buckets, their posting lists, and the inserts not built in yet
+    void countBytes(ByteCount& table, ByteCount& postings, ByteCount& pending) const;
+    //builds first if needed, false if that fails; a loaded table is a view into the reader's file
+    bool save(IndexWriter& writer);
+    bool load(IndexReader& reader);
+
+    // C++11 syntax for preventing copying and assignment
+    KmerTable(const KmerTable&) = delete;
+    KmerTable& operator=(const KmerTable&) = delete;
+private:
+    static const size_t MIN_SPILL=1<<20;
+    struct Entry
+    {
+        uint64_t kmer;
+        int value;
+    };
+    //count entries from offset in m_spill, sorted
+    struct Run
+    {
+        size_t offset;
+        size_t count;
+    };
+    int m_k;
+    std::vector<Entry> m_pending;
+    Storage<uint64_t> m_kmers;    //every distinct k-mer, sorted
+    PostingStore m_postings;      //list i holds the values of m_kmers[i]
+    Storage<int> m_buckets;       //m_buckets[b] is the first k-mer whose top m_bucketBits bits are b or more
+    int m_bucketBits;
+    size_t m_spillBudget;         //0 if the pending inserts aren't spilled
+    std::string m_spillDirectory;
+    std::unique_ptr<SpillFile> m_spill;
+    std::vector<Run> m_runs;
+
+    uint64_t bucket(uint64_t kmer) const
+    {
+        return m_bucketBits==0 ? 0 : kmer>>(2*m_k-m_bucketBits);
+    }
+    static bool less(const Entry& a, const Entry& b)
+    {
+        return a.kmer<b.kmer || (a.kmer==b.kmer && a.value<b.value);
+    }
+    //sort the pending inserts into a new run, false if the spill file can't be written
+    bool spill();
+    //merge the runs into the table, false if its files can't be written
+    bool mergeRuns();
+    //read the runs back into the pending inserts, for building in memory after all; false if one can't be
+    bool unspill();
+    //sort the pending inserts in with what is in the table, in memory
+    void buildInMemory();
+    //make m_buckets for m_kmers
+    void setBuckets();
+    //whether a loaded table holds together: k-mers of k bases in increasing order, and buckets that
+    //start at 0, never go back, end at the last k-mer and put every k-mer in its own bucket
+    bool valid() const;
+};
+
+inline KmerTable::KmerTable(int k)
+: m_k(k), m_spillBudget(0)
+{
+    reset();
+}
+
+inline void KmerTable::reset()
+{
+    m_pending.clear();
+    m_kmers.clear();
+    m_postings.reset();
+    m_buckets.clear();
+    m_buckets.push_back(0);
+    m_buckets.push_back(0);
+    m_bucketBits=0;
+    m_spill.reset();
+    m_runs.clear();
+}
+
+inline void KmerTable::setSpill(size_t budget, const std::string& directory)
+{
+    m_spillBudget=(budget==0) ? 0 : (budget<MIN_SPILL ? MIN_SPILL : budget);
+    m_spillDirectory=directory;
+}
+
+inline void KmerTable::insert(uint64_t kmer, int value)
+{
+    m_pending.push_back(Entry{kmer, value});
+    //if the disk won't take it, carry on in memory
+    if (m_spillBudget>0 && m_pending.size()*sizeof(Entry)>=m_spillBudget && !spill())
+        m_spillBudget=0;
+}
+
+inline bool KmerTable::built() const
+{
+    return m_pending.empty() && m_runs.empty();
+}
+
+inline int KmerTable::k() const
+{
+    return m_k;
+}
+
+//A table is built once, so the table so far is normally empty here; should it not be, it is put back
+//among the inserts and everything is built again. Once anything has been spilled, everything is: the
+//table so far and the last pending inserts become runs too, so that the merge is the one place it all
+//comes together.
+inline bool KmerTable::build()
+{
+    if (m_runs.empty())
+    {
+        buildInMemory();
+        return true;
+    }
+    if (!m_kmers.empty())
+    {
+        const Storage<uint64_t>& kmers=m_kmers;
+        for (size_t i=0;i<kmers.size();i++)
+            m_postings.forEach(static_cast<int>(i), [&](int value) { insert(kmers[i], value); });
+        m_kmers.clear();
+        m_postings.reset();
+        setBuckets();
+    }
+    if ((!m_pending.empty() && !spill()) || !mergeRuns())
+    {
+        if (!unspill())
+            return false;
+        buildInMemory();
+    }
+    return true;
+}
+
+inline void KmerTable::buildInMemory()
+{
+    if (m_pending.empty())
+        return;
+    //what is already in the table is sorted, so only the new entries need sorting before the merge
+    std::sort(m_pending.begin(), m_pending.end(), less);
+    std::vector<Entry> entries;
+    if (m_kmers.empty())
+        entries.swap(m_pending);
+    else
+    {
+        entries.reserve(m_pending.size()*2);
+        const Storage<uint64_t>& kmers=m_kmers;
+        for (size_t i=0;i<kmers.size();i++)
+            m_postings.forEach(static_cast<int>(i), [&](int value) { entries.push_back(Entry{kmers[i], value}); });
+        size_t old=entries.size();
+        entries.insert(entries.end(), m_pending.begin(), m_pending.end());
+        std::inplace_merge(entries.begin(), entries.begin()+old, entries.end(), less);
+    }
+    m_pending.clear();
+    m_pending.shrink_to_fit();
+
+    std::vector<uint64_t> kmers;
+    PostingStore postings;
+    std::vector<int> values;
+    for (size_t i=0;i<entries.size();)
+    {
+        uint64_t kmer=entries[i].kmer;
+        values.clear();
+        for (;i<entries.size() && entries[i].kmer==kmer;i++)
+            values.push_back(entries[i].value);
+        kmers.push_back(kmer);
+        postings.addList(values.data(), values.size());
+    }
+    entries.clear();
+    entries.shrink_to_fit();
+    m_kmers=std::move(kmers);
+    m_postings=std::move(postings);
+    setBuckets();
+}
+
+inline void KmerTable::setBuckets()
+{
+    //a few k-mers per bucket keeps the bucket table small next to the k-mers themselves
+    const Storage<uint64_t>& kmers=m_kmers;
+    m_bucketBits=0;
+    while (m_bucketBits<2*m_k && (size_t(4)<<m_bucketBits)<kmers.size())
+        m_bucketBits++;
+    std::vector<int> buckets((size_t(1)<<m_bucketBits)+1);
+    size_t i=0;
+    for (size_t b=0;b<buckets.size();b++)
+    {
+        for (;i<kmers.size() && bucket(kmers[i])<b;i++)
+            ;
+        buckets[b]=static_cast<int>(i);
+    }
+    m_buckets=std::move(buckets);
+}
+
+inline bool KmerTable::spill()
+{
+    if (!m_spill)
+        m_spill=SpillFile::create(m_spillDirectory);
+    if (!m_spill)
+        return false;
+    std::sort(m_pending.begin(), m_pending.end(), less);
+    size_t offset=m_spill->size();
+    if (!m_spill->append(m_pending.data(), m_pending.size()*sizeof(Entry)) || !m_spill->flush())
+        return false;
+    m_runs.push_back(Run{offset, m_pending.size()});
+    m_pending.clear();
+    return true;
+}
+
+//A k-way merge, each run read through a buffer of its own, the buffers together about the budget. The
+//k-mers, the encoded posting lists and where each list starts go out to three files as they are made.
+inline bool KmerTable::mergeRuns()
+{
+    std::unique_ptr<SpillFile> kmerFile=SpillFile::create(m_spillDirectory);
+    std::unique_ptr<SpillFile> byteFile=SpillFile::create(m_spillDirectory);
+    std::unique_ptr<SpillFile> startFile=SpillFile::create(m_spillDirectory);
+    if (!kmerFile || !byteFile || !startFile)
+        return false;
+    size_t bufferEntries=std::min<size_t>(std::max<size_t>(m_spillBudget/sizeof(Entry)/m_runs.size(), 256), 1<<16);
+    struct Cursor
+    {
+        size_t next;    //the next entry of the run to read into buffer
+        std::vector<Entry> buffer;
+        size_t at;      //the next entry of buffer to merge
+    };
+    std::vector<Cursor> cursors(m_runs.size());
+    //fill cursor r's buffer again, false once the run is done
+    auto refill=[&](size_t r)
+    {
+        Cursor& cursor=cursors[r];
+        size_t n=std::min(bufferEntries, m_runs[r].count-cursor.next);
+        cursor.buffer.resize(n);
+        cursor.at=0;
+        if (n==0 || !m_spill->read(m_runs[r].offset+cursor.next*sizeof(Entry), cursor.buffer.data(), n*sizeof(Entry)))
+            return false;
+        cursor.next+=n;
+        return true;
+    };
+    //the smallest entry on top
+    auto later=[&](size_t a, size_t b) { return less(cursors[b].buffer[cursors[b].at], cursors[a].buffer[cursors[a].at]); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+    for (size_t r=0;r<m_runs.size();r++)
+    {
+        cursors[r].next=0;
+        if (refill(r))
+            heads.push(r);
+    }
+    size_t kmers=0;
+    uint64_t start=0;
+    std::vector<int> values;
+    std::vector<uint8_t> encoded;
+    bool ok=true;
+    while (ok && !heads.empty())
+    {
+        uint64_t kmer=cursors[heads.top()].buffer[cursors[heads.top()].at].kmer;
+        values.clear();
+        while (!heads.empty() && cursors[heads.top()].buffer[cursors[heads.top()].at].kmer==kmer)
+        {
+            size_t r=heads.top();
+            heads.pop();
+            values.push_back(cursors[r].buffer[cursors[r].at++].value);
+            if (cursors[r].at<cursors[r].buffer.size() || refill(r))
+                heads.push(r);
+        }
+        encoded.clear();
+        PostingStore::encodeList(values.data(), values.size(), encoded);
+        ok=kmerFile->append(&kmer, sizeof(kmer)) && startFile->append(&start, sizeof(start))
+           && byteFile->append(encoded.data(), encoded.size());
+        start+=encoded.size();
+        kmers++;
+    }
+    //a run that stopped short couldn't be read
+    for (size_t r=0;r<m_runs.size();r++)
+        ok=ok && cursors[r].next==m_runs[r].count;
+    if (!ok || !startFile->append(&start, sizeof(start)))
+        return false;
+    std::shared_ptr<MappedFile> kmerMap=kmerFile->map(), byteMap=byteFile->map(), startMap=startFile->map();
+    if (!kmerMap || !byteMap || !startMap)
+        return false;
+    Storage<uint64_t> kmerView;
+    Storage<uint8_t> byteView;
+    Storage<uint64_t> startView;
+    kmerView.attach(reinterpret_cast<const uint64_t*>(kmerMap->data()), kmers, kmerMap);
+    byteView.attach(reinterpret_cast<const uint8_t*>(byteMap->data()), start, byteMap);
+    startView.attach(reinterpret_cast<const uint64_t*>(startMap->data()), kmers+1, startMap);
+    if (!m_postings.assign(byteView, startView))
+        return false;
+    m_kmers=std::move(kmerView);
+    setBuckets();
+    m_pending.clear();
+    m_pending.shrink_to_fit();
+    m_runs.clear();
+    m_spill.reset();
+    return true;
+}
+
+inline bool KmerTable::unspill()
+{
+    for (size_t r=0;r<m_runs.size();r++)
+    {
+        size_t old=m_pending.size();
+        m_pending.resize(old+m_runs[r].count);
+        if (!m_spill->read(m_runs[r].offset, m_pending.data()+old, m_runs[r].count*sizeof(Entry)))
+        {
+            //the runs stay, so the table isn't built() and nothing claims these values are in it
+            m_pending.resize(old);
+            return false;
+        }
+    }
+    m_runs.clear();
+    m_spill.reset();
+    m_spillBudget=0;
+    return true;
+}
+
+inline bool KmerTable::valid() const
+{
+    //read through the const accessors, so a view stays a view
+    const Storage<uint64_t>& kmers=m_kmers;
+    const Storage<int>& buckets=m_buckets;
+    uint64_t limit=(m_k==MAX_K) ? ~0ULL : (1ULL<<(2*m_k))-1;
+    if (kmers.size()>static_cast<size_t>(INT_MAX) || buckets[0]!=0 || buckets.back()!=static_cast<int>(kmers.size()))
+        return false;
+    for (size_t b=0;b+1<buckets.size();b++)
+    {
+        if (buckets[b+1]<buckets[b])
+            return false;
+    }
+    for (size_t i=0;i<kmers.size();i++)
+    {
+        if (kmers[i]>limit || (i>0 && kmers[i]<=kmers[i-1]))
+            return false;
+        uint64_t b=bucket(kmers[i]);
+        if (static_cast<int>(i)<buckets[b] || static_cast<int>(i)>=buckets[b+1])
+            return false;
+    }
+    return true;
+}
+
+template<typename Visitor>
+void KmerTable::forEach(uint64_t kmer, Visitor visit) const
+{
+    uint64_t b=bucket(kmer);
+    const uint64_t* first=m_kmers.begin()+m_buckets[b];
+    const uint64_t* last=m_kmers.begin()+m_buckets[b+1];
+    const uint64_t* found=std::lower_bound(first, last, kmer);
+    if (found==last || *found!=kmer)
+        return;
+    m_postings.forEach(static_cast<int>(found-m_kmers.begin()), visit);
+}
+
+inline void KmerTable::countBytes(ByteCount& table, ByteCount& postings, ByteCount& pending) const
+{
+    table.add(m_kmers);
+    table.add(m_buckets);
+    m_postings.countBytes(postings, pending);
+    pending.add(m_pending);
+}
+
+inline bool KmerTable::save(IndexWriter& writer)
+{
+    if (!build())
+        return false;
+    writer.write(static_cast<int32_t>(m_k));
+    writer.write(static_cast<int32_t>(m_bucketBits));
+    writer.writeArray(m_kmers);
+    m_postings.save(writer);
+    writer.writeArray(m_buckets);
+    return true;
+}
+
+inline bool KmerTable::load(IndexReader& reader)
+{
+    int32_t k, bucketBits;
+    if (!reader.read(k) || !reader.read(bucketBits) || k!=m_k || bucketBits<0 || bucketBits>2*k || bucketBits>=31
+        || !reader.readArray(m_kmers) || !m_postings.load(reader) || !reader.readArray(m_buckets)
+        || m_postings.lists()!=static_cast<int>(m_kmers.size()) || m_buckets.size()!=(size_t(1)<<bucketBits)+1)
+    {
+        reset();
+        return false;
+    }
+    m_bucketBits=bucketBits;
+    if (!valid())
+    {
+        reset();
+        return false;
+    }
+    m_pending.clear();
+    m_spill.reset();
+    m_runs.clear();
+    return true;
+}
+
+#endif // KMERTABLE_INCLUDED
@@ -0,0 +1,478 @@
+#ifndef MAPPEDSTORAGE_INCLUDED
+#define MAPPEDSTORAGE_INCLUDED
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//A whole file mapped read-only into memory. Processes that map the same file share its pages.
+class MappedFile
+{
+public:
+    //nullptr if the file can't be opened or mapped
+    static std::shared_ptr<MappedFile> open(const std::string& filename)
+    {
+        int fd=::open(filename.c_str(), O_RDONLY);
+        if (fd<0)
+            return nullptr;
+        std::shared_ptr<MappedFile> file=map(fd);
+        //the mapping keeps the file alive on its own
+        ::close(fd);
+        return file;
+    }
+    //the same for a file that is already open; fd can be closed afterwards
+    static std::shared_ptr<MappedFile> map(int fd)
+    {
+        struct stat info;
+        if (fstat(fd, &info)!=0 || info.st_size==0)
+            return nullptr;
+        void* data=mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data==MAP_FAILED)
+            return nullptr;
+        return std::shared_ptr<MappedFile>(new MappedFile(static_cast<const char*>(data), info.st_size));
+    }
+    ~MappedFile()
+    {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+    const char* data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+private:
+    MappedFile(const char* data, size_t size)
+    : m_data(data), m_size(size)
+    {
+    }
+    const char* m_data;
+    size_t m_size;
+};
+
+//An array that either owns its elements (a std::vector) or is a read-only view into a MappedFile.
+//Reads go through one pointer either way; the first write to a view copies it into memory it owns.
+template<typename T>
+class Storage
+{
+public:
+    Storage()
+    : m_data(nullptr), m_size(0)
+    {
+    }
+    Storage(const Storage& other)
+    : m_owned(other.m_owned), m_file(other.m_file)
+    {
+        point(other);
+    }
+    Storage(Storage&& other)
+    : m_owned(std::move(other.m_owned)), m_file(std::move(other.m_file))
+    {
+        point(other);
+        other.refresh();
+    }
+    Storage& operator=(Storage&& rhs)
+    {
+        if (this!=&rhs)
+        {
+            m_owned=std::move(rhs.m_owned);
+            m_file=std::move(rhs.m_file);
+            point(rhs);
+            rhs.m_owned.clear();
+            rhs.refresh();
+        }
+        return *this;
+    }
+    Storage& operator=(const Storage& rhs)
+    {
+        if (this!=&rhs)
+        {
+            m_owned=rhs.m_owned;
+            m_file=rhs.m_file;
+            point(rhs);
+        }
+        return *this;
+    }
+    Storage& operator=(std::vector<T>&& elements)
+    {
+        m_owned=std::move(elements);
+        m_file.reset();
+        refresh();
+        return *this;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+    bool empty() const
+    {
+        return m_size==0;
+    }
+    const T* data() const
+    {
+        return m_data;
+    }
+    const T* begin() const
+    {
+        return m_data;
+    }
+    const T* end() const
+    {
+        return m_data+m_size;
+    }
+    const T& operator[](size_t i) const
+    {
+        return m_data[i];
+    }
+    T& operator[](size_t i)
+    {
+        own();
+        return m_owned[i];
+    }
+    const T& back() const
+    {
+        return m_data[m_size-1];
+    }
+    T& back()
+    {
+        own();
+        return m_owned.back();
+    }
+    void push_back(const T& value)
+    {
+        own();
+        m_owned.push_back(value);
+        refresh();
+    }
+    void resize(size_t n)
+    {
+        own();
+        m_owned.resize(n);
+        refresh();
+    }
+    void reserve(size_t n)
+    {
+        own();
+        m_owned.reserve(n);
+        refresh();
+    }
+    void clear()
+    {
+        m_owned.clear();
+        m_file.reset();
+        refresh();
+    }
+    bool mapped() const
+    {
+        return m_file!=nullptr;
+    }
+    //the memory this owns (its capacity), and the bytes of the file it views
+    size_t ownedBytes() const
+    {
+        return m_owned.capacity()*sizeof(T);
+    }
+    size_t mappedBytes() const
+    {
+        return m_file ? m_size*sizeof(T) : 0;
+    }
+    //become a view of n elements inside file
+    void attach(const T* data, size_t n, const std::shared_ptr<MappedFile>& file)
+    {
+        m_owned.clear();
+        m_owned.shrink_to_fit();
+        m_file=file;
+        m_data=data;
+        m_size=n;
+    }
+private:
+    std::vector<T> m_owned;
+    std::shared_ptr<MappedFile> m_file;   //set while this is a view, keeps the mapping alive
+    const T* m_data;
+    size_t m_size;
+
+    void refresh()
+    {
+        m_data=m_owned.data();
+        m_size=m_owned.size();
+    }
+    void point(const Storage& other)
+    {
+        if (m_file)
+        {
+            m_data=other.m_data;
+            m_size=other.m_size;
+        }
+        else
+            refresh();
+    }
+    void own()
+    {
+        if (!m_file)
+            return;
+        m_owned.assign(m_data, m_data+m_size);
+        m_file.reset();
+        refresh();
+    }
+};
+
+//What a structure takes up, for the memory accounting: the memory it owns, and the pages of mapped files it
+//views, which the kernel can drop and read back at any time, so don't need memory of their own.
+struct ByteCount
+{
+    long long owned = 0;
+    long long mapped = 0;
+
+    template<typename T>
+    void add(const Storage<T>& elements)
+    {
+        owned+=elements.ownedBytes();
+        mapped+=elements.mappedBytes();
+    }
+    template<typename T>
+    void add(const std::vector<T>& elements)
+    {
+        owned+=elements.capacity()*sizeof(T);
+    }
+};
+
+//A scratch file for what doesn't fit in memory while it is being built. It is made in directory ($TMPDIR,
+//or /tmp, if that is empty) and unlinked at once, so it goes away with its last user, even after a crash.
+//Bytes are appended to the end, through a buffer, and read back from anywhere, or the whole file mapped.
+//Once a write fails (a full disk, say) every later append() and flush() fails too; what was written out
+//before it can still be read.
+class SpillFile
+{
+public:
+    //nullptr if the file can't be made
+    static std::unique_ptr<SpillFile> create(const std::string& directory)
+    {
+        std::string dir=directory;
+        if (dir.empty())
+        {
+            const char* tmp=std::getenv("TMPDIR");
+            dir=(tmp!=nullptr && *tmp!='\0') ? tmp : "/tmp";
+        }
+        std::string pattern=dir+"/geenomics-spill-XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        int fd=mkstemp(name.data());
+        if (fd<0)
+            return nullptr;
+        ::unlink(name.data());
+        return std::unique_ptr<SpillFile>(new SpillFile(fd));
+    }
+    ~SpillFile()
+    {
+        ::close(m_fd);
+    }
+    bool append(const void* data, size_t n)
+    {
+        if (m_buffer.size()+n>BUFFER_SIZE && !flush())
+            return false;
+        //a big block goes straight to the file rather than through the buffer
+        if (n>=BUFFER_SIZE)
+            return write(data, n);
+        const char* p=static_cast<const char*>(data);
+        m_buffer.insert(m_buffer.end(), p, p+n);
+        return true;
+    }
+    //write out what is buffered
+    bool flush()
+    {
+        bool ok=write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        return ok;
+    }
+    //the bytes written out so far, not counting the buffer
+    size_t size() const
+    {
+        return m_size;
+    }
+    bool read(size_t offset, void* data, size_t n) const
+    {
+        char* p=static_cast<char*>(data);
+        if (offset+n>m_size)
+            return false;
+        for (size_t done=0;done<n;)
+        {
+            ssize_t got=::pread(m_fd, p+done, n-done, offset+done);
+            if (got<=0)
+                return false;
+            done+=got;
+        }
+        return true;
+    }
+    //flush and map the whole file, nullptr if it is empty or that fails
+    std::shared_ptr<MappedFile> map()
+    {
+        if (!flush())
+            return nullptr;
+        return MappedFile::map(m_fd);
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+private:
+    static const size_t BUFFER_SIZE=1<<20;
+    int m_fd;
+    size_t m_size;
+    bool m_ok;
+    std::vector<char> m_buffer;
+
+    explicit SpillFile(int fd)
+    : m_fd(fd), m_size(0), m_ok(true)
+    {
+    }
+    bool write(const void* data, size_t n)
+    {
+        const char* p=static_cast<const char*>(data);
+        for (size_t done=0;m_ok && done<n;)
+        {
+            ssize_t put=::pwrite(m_fd, p+done, n-done, m_size);
+            if (put<=0)
+                m_ok=false;
+            else
+            {
+                done+=put;
+                m_size+=put;
+            }
+        }
+        return m_ok;
+    }
+};
+
+//Writes the binary index format: every item is padded to a multiple of 8 bytes so that arrays can
+//be used straight out of the mapped file.
+class IndexWriter
+{
+public:
+    explicit IndexWriter(const std::string& filename)
+    : m_out(filename, std::ios::binary | std::ios::trunc), m_offset(0)
+    {
+    }
+    bool ok() const
+    {
+        return static_cast<bool>(m_out);
+    }
+    template<typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be written");
+        writeBytes(&value, sizeof(T));
+    }
+    template<typename T>
+    void writeArray(const T* data, size_t n)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be written");
+        write(static_cast<uint64_t>(n));
+        writeBytes(data, n*sizeof(T));
+    }
+    template<typename T>
+    void writeArray(const Storage<T>& elements)
+    {
+        writeArray(elements.data(), elements.size());
+    }
+    template<typename T>
+    void writeArray(const std::vector<T>& elements)
+    {
+        writeArray(elements.data(), elements.size());
+    }
+    void writeString(const std::string& s)
+    {
+        writeArray(s.data(), s.size());
+    }
+private:
+    std::ofstream m_out;
+    uint64_t m_offset;
+
+    void writeBytes(const void* data, size_t n)
+    {
+        m_out.write(static_cast<const char*>(data), n);
+        m_offset+=n;
+        static const char zeros[8]={0};
+        size_t pad=(8-m_offset%8)%8;
+        m_out.write(zeros, pad);
+        m_offset+=pad;
+    }
+};
+
+//Reads what IndexWriter wrote back out of a MappedFile. Arrays become views into the mapping, nothing
+//is copied. Every read is bounds checked and returns false on a short or corrupt file.
+class IndexReader
+{
+public:
+    explicit IndexReader(const std::shared_ptr<MappedFile>& file)
+    : m_file(file), m_offset(0)
+    {
+    }
+    template<typename T>
+    bool read(T& value)
+    {
+        const char* p=take(sizeof(T));
+        if (p==nullptr)
+            return false;
+        std::memcpy(&value, p, sizeof(T));
+        return true;
+    }
+    template<typename T>
+    bool readArray(Storage<T>& elements)
+    {
+        uint64_t n;
+        if (!read(n) || n>m_file->size()/sizeof(T)+1)
+            return false;
+        const char* p=take(n*sizeof(T));
+        if (p==nullptr)
+            return false;
+        elements.attach(reinterpret_cast<const T*>(p), n, m_file);
+        return true;
+    }
+    template<typename T>
+    bool readArray(std::vector<T>& elements)
+    {
+        Storage<T> view;
+        if (!readArray(view))
+            return false;
+        elements.assign(view.begin(), view.end());
+        return true;
+    }
+    bool readString(std::string& s)
+    {
+        Storage<char> view;
+        if (!readArray(view))
+            return false;
+        s.assign(view.begin(), view.end());
+        return true;
+    }
+private:
+    std::shared_ptr<MappedFile> m_file;
+    size_t m_offset;
+
+    const char* take(size_t n)
+    {
+        size_t padded=n+(8-n%8)%8;
+        if (m_offset+n>m_file->size())
+            return nullptr;
+        const char* p=m_file->data()+m_offset;
+        m_offset=std::min(m_offset+padded, m_file->size());
+        return p;
+    }
+};
+
+#endif // MAPPEDSTORAGE_INCLUDED
@@ -0,0 +1,190 @@
+#ifndef MATCHKERNEL_INCLUDED
+#define MATCHKERNEL_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GEENOMICS_X86_KERNELS
+#endif
+
+//The inner loop of extending a match: how many whole 32-base words two packed sequences agree on from
+//given positions. Each sequence is given as its word array from the word holding the first base, and how
+//many bits into that word the first base starts, so word k of it is a[k]>>shift joined with the low bits
+//of a[k+1]. Both arrays must be readable for words+1 words. Returns the index of the first word that
+//differs, or words if they all agree.
+//
+//There is a plain version and, on x86 with GCC or Clang, SSE4.2, AVX2 and AVX-512 ones comparing 2, 4
+//and 8 words (64 to 256 bases) a step. They are compiled for their instruction sets function by function,
+//so no special flags are needed, and the best one the CPU has is picked the first time one is called.
+//Every kernel gives the same answer; useMatchKernel() switches between them to check or time that.
+
+enum class MatchKernel
+{
+    Scalar,
+    SSE42,
+    AVX2,
+    AVX512
+};
+
+typedef int (*EqualWordsFunction)(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words);
+
+inline uint64_t shiftedWord(const uint64_t* words, int k, int shift)
+{
+    return (shift==0) ? words[k] : (words[k]>>shift) | (words[k+1]<<(64-shift));
+}
+
+inline int equalWordsScalar(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words)
+{
+    for (int k=0;k<words;k++)
+    {
+        if (shiftedWord(a, k, aShift)!=shiftedWord(b, k, bShift))
+            return k;
+    }
+    return words;
+}
+
+#ifdef GEENOMICS_X86_KERNELS
+
+//A vector shift by 64 gives 0, unlike a scalar one, so a shift of 0 needs no special case: the next word
+//just contributes nothing. Once a step finds a difference the plain loop pins down which word it is in.
+
+__attribute__((target("sse4.2")))
+inline int equalWordsSSE42(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words)
+{
+    __m128i aRight=_mm_cvtsi32_si128(aShift), aLeft=_mm_cvtsi32_si128(64-aShift);
+    __m128i bRight=_mm_cvtsi32_si128(bShift), bLeft=_mm_cvtsi32_si128(64-bShift);
+    int k=0;
+    for (;k+2<=words;k+=2)
+    {
+        __m128i va=_mm_or_si128(_mm_srl_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+k)), aRight),
+                                _mm_sll_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+k+1)), aLeft));
+        __m128i vb=_mm_or_si128(_mm_srl_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+k)), bRight),
+                                _mm_sll_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b+k+1)), bLeft));
+        __m128i x=_mm_xor_si128(va, vb);
+        if (!_mm_testz_si128(x, x))
+            break;
+    }
+    return k+equalWordsScalar(a+k, aShift, b+k, bShift, words-k);
+}
+
+__attribute__((target("avx2")))
+inline int equalWordsAVX2(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words)
+{
+    __m128i aRight=_mm_cvtsi32_si128(aShift), aLeft=_mm_cvtsi32_si128(64-aShift);
+    __m128i bRight=_mm_cvtsi32_si128(bShift), bLeft=_mm_cvtsi32_si128(64-bShift);
+    int k=0;
+    for (;k+4<=words;k+=4)
+    {
+        __m256i va=_mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+k)), aRight),
+                                   _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+k+1)), aLeft));
+        __m256i vb=_mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+k)), bRight),
+                                   _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+k+1)), bLeft));
+        __m256i x=_mm256_xor_si256(va, vb);
+        if (!_mm256_testz_si256(x, x))
+            break;
+    }
+    return k+equalWordsScalar(a+k, aShift, b+k, bShift, words-k);
+}
+
+//Every load and shift is masked to the lanes in range, with the rest zero: the last step takes just the
+//words left and leaves the other lanes out of the compare, so there is no plain tail loop, and the first
+//differing lane is the answer.
+__attribute__((target("avx512f")))
+inline int equalWordsAVX512(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words)
+{
+    __m512i aRight=_mm512_set1_epi64(aShift), aLeft=_mm512_set1_epi64(64-aShift);
+    __m512i bRight=_mm512_set1_epi64(bShift), bLeft=_mm512_set1_epi64(64-bShift);
+    for (int k=0;k<words;k+=8)
+    {
+        __mmask8 lanes=(words-k>=8) ? 0xff : static_cast<__mmask8>((1u<<(words-k))-1);
+        __m512i va=_mm512_or_si512(_mm512_maskz_srlv_epi64(lanes, _mm512_maskz_loadu_epi64(lanes, a+k), aRight),
+                                   _mm512_maskz_sllv_epi64(lanes, _mm512_maskz_loadu_epi64(lanes, a+k+1), aLeft));
+        __m512i vb=_mm512_or_si512(_mm512_maskz_srlv_epi64(lanes, _mm512_maskz_loadu_epi64(lanes, b+k), bRight),
+                                   _mm512_maskz_sllv_epi64(lanes, _mm512_maskz_loadu_epi64(lanes, b+k+1), bLeft));
+        __mmask8 differ=_mm512_mask_cmpneq_epi64_mask(lanes, va, vb);
+        if (differ!=0)
+            return k+__builtin_ctz(differ);
+    }
+    return words;
+}
+
+#endif // GEENOMICS_X86_KERNELS
+
+inline bool matchKernelSupported(MatchKernel kernel)
+{
+    switch (kernel)
+    {
+        case MatchKernel::Scalar:
+            return true;
+#ifdef GEENOMICS_X86_KERNELS
+        case MatchKernel::SSE42:
+            return __builtin_cpu_supports("sse4.2");
+        case MatchKernel::AVX2:
+            return __builtin_cpu_supports("avx2");
+        case MatchKernel::AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+inline const char* matchKernelName(MatchKernel kernel)
+{
+    switch (kernel)
+    {
+        case MatchKernel::Scalar: return "scalar";
+        case MatchKernel::SSE42:  return "sse4.2";
+        case MatchKernel::AVX2:   return "avx2";
+        case MatchKernel::AVX512: return "avx512";
+    }
+    return "";
+}
+
+inline EqualWordsFunction matchKernelFunction(MatchKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef GEENOMICS_X86_KERNELS
+        case MatchKernel::SSE42:  return equalWordsSSE42;
+        case MatchKernel::AVX2:   return equalWordsAVX2;
+        case MatchKernel::AVX512: return equalWordsAVX512;
+#endif
+        default:                  return equalWordsScalar;
+    }
+}
+
+//the fastest kernel this CPU runs
+inline MatchKernel bestMatchKernel()
+{
+    const MatchKernel fastestFirst[]={MatchKernel::AVX512, MatchKernel::AVX2, MatchKernel::SSE42};
+    for (MatchKernel kernel : fastestFirst)
+    {
+        if (matchKernelSupported(kernel))
+            return kernel;
+    }
+    return MatchKernel::Scalar;
+}
+
+inline std::atomic<EqualWordsFunction>& equalWordsKernel()
+{
+    static std::atomic<EqualWordsFunction> kernel(matchKernelFunction(bestMatchKernel()));
+    return kernel;
+}
+
+//run every later comparison on kernel; false, changing nothing, if the CPU doesn't have it
+inline bool useMatchKernel(MatchKernel kernel)
+{
+    if (!matchKernelSupported(kernel))
+        return false;
+    equalWordsKernel().store(matchKernelFunction(kernel), std::memory_order_relaxed);
+    return true;
+}
+
+inline int equalWords(const uint64_t* a, int aShift, const uint64_t* b, int bShift, int words)
+{
+    return equalWordsKernel().load(std::memory_order_relaxed)(a, aShift, b, bShift, words);
+}
+
+#endif // MATCHKERNEL_INCLUDED
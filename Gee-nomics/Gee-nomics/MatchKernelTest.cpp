@@ -0,0 +1,148 @@
+//
+//  MatchKernelTest.cpp
+//  Gee-nomics
+//
+//  A test of the match kernels in MatchKernel.h: every kernel the CPU has is run against equalWordsScalar
+//  on word counts from 0 up past a few vector widths, so every length of tail comes up, with every pair
+//  of shifts and a difference in every word (or none). Each array is placed right before an unreadable
+//  page, so a kernel reading past the words+1 words it is allowed fails loudly. It has its own main(),
+//  so build it apart from main.cpp:
+//
+//      g++ -std=c++17 -O2 MatchKernelTest.cpp -o matchkerneltest
+//      ./matchkerneltest
+//
+//  It exits with 1 if any kernel disagrees.
+//
+
+#include <iostream>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "MatchKernel.h"
+using namespace std;
+
+const MatchKernel ALL_KERNELS[]={MatchKernel::Scalar, MatchKernel::SSE42, MatchKernel::AVX2, MatchKernel::AVX512};
+const int MAX_WORDS=24;
+
+//Room for n words that ends where a page nobody may read begins.
+class GuardedWords
+{
+public:
+    explicit GuardedWords(int n)
+    : m_n(n)
+    {
+        m_pageSize=static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        m_bytes=((n*sizeof(uint64_t)+m_pageSize-1)/m_pageSize+1)*m_pageSize;
+        void* block=mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        m_block=static_cast<char*>(block==MAP_FAILED ? nullptr : block);
+        if (m_block!=nullptr)
+            mprotect(m_block+m_bytes-m_pageSize, m_pageSize, PROT_NONE);
+    }
+    ~GuardedWords()
+    {
+        if (m_block!=nullptr)
+            munmap(m_block, m_bytes);
+    }
+    bool ok() const
+    {
+        return m_block!=nullptr;
+    }
+    uint64_t* words() const
+    {
+        return reinterpret_cast<uint64_t*>(m_block+m_bytes-m_pageSize)-m_n;
+    }
+    // C++11 syntax for preventing copying and assignment
+    GuardedWords(const GuardedWords&) = delete;
+    GuardedWords& operator=(const GuardedWords&) = delete;
+private:
+    int m_n;
+    size_t m_pageSize;
+    size_t m_bytes;
+    char* m_block;
+};
+
+//Lay the words of logical out shift bits into out (words+1 of them), so shiftedWord(out, k, shift) is
+//logical[k]; the bits before and after it are filler.
+void pack(const vector<uint64_t>& logical, int shift, mt19937_64& rng, uint64_t* out)
+{
+    int words=static_cast<int>(logical.size());
+    for (int k=0;k<=words;k++)
+        out[k]=rng();
+    if (shift==0)
+    {
+        for (int k=0;k<words;k++)
+            out[k]=logical[k];
+        return;
+    }
+    uint64_t low=(1ULL<<shift)-1;
+    for (int k=0;k<words;k++)
+    {
+        out[k]=(out[k]&low) | (logical[k]<<shift);
+        out[k+1]=(out[k+1]&~low) | (logical[k]>>(64-shift));
+    }
+}
+
+//Every shift pair, every word count up to MAX_WORDS, and a difference in each word or none; the answer
+//must be the scalar one and the word that was changed.
+int testKernel(MatchKernel kernel)
+{
+    EqualWordsFunction equal=matchKernelFunction(kernel);
+    mt19937_64 rng(7);
+    int failures=0;
+    for (int words=0;words<=MAX_WORDS && failures<5;words++)
+    {
+        GuardedWords a(words+1), b(words+1);
+        if (!a.ok() || !b.ok())
+        {
+            cout << "cannot map the test arrays" << endl;
+            return 1;
+        }
+        vector<uint64_t> logical(words), changed;
+        for (int aShift=0;aShift<64;aShift++)
+        {
+            for (int bShift=0;bShift<64;bShift++)
+            {
+                for (int differ=0;differ<=words;differ++)
+                {
+                    for (int k=0;k<words;k++)
+                        logical[k]=rng();
+                    changed=logical;
+                    if (differ<words)
+                        changed[differ]^=1ULL<<(rng()%64);
+                    pack(logical, aShift, rng, a.words());
+                    pack(changed, bShift, rng, b.words());
+                    int expected=equalWordsScalar(a.words(), aShift, b.words(), bShift, words);
+                    int found=equal(a.words(), aShift, b.words(), bShift, words);
+                    if (found!=expected || expected!=differ)
+                    {
+                        if (failures<5)
+                            cout << matchKernelName(kernel) << ": " << words << " words, shifts " << aShift << " and " << bShift
+                                 << ", differing at " << differ << ": gave " << found << ", scalar gave " << expected << endl;
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+int main()
+{
+    bool ok=true;
+    for (MatchKernel kernel : ALL_KERNELS)
+    {
+        if (!matchKernelSupported(kernel))
+        {
+            cout << matchKernelName(kernel) << ": not supported by this CPU, skipped" << endl;
+            continue;
+        }
+        if (testKernel(kernel)>0)
+            ok=false;
+        else
+            cout << matchKernelName(kernel) << ": ok" << endl;
+    }
+    return ok ? 0 : 1;
+}
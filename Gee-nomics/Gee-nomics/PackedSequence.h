@@ -0,0 +1,283 @@
+#ifndef PACKEDSEQUENCE_INCLUDED
+#define PACKEDSEQUENCE_INCLUDED
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include "MappedStorage.h"
+#include "MatchKernel.h"
+
+//A DNA sequence stored at 2 bits per base (A=0, C=1, G=2, T=3), 32 bases per 64-bit word.
+//N can't fit in 2 bits, so it is stored as code 0 and remembered in a sorted list of runs.
+//Base i lives in word i/32 at bits 2*(i%32), so shifting a word right walks forward through the sequence.
+class PackedSequence
+{
+public:
+    static constexpr int BASES_PER_WORD=32;
+    static constexpr uint64_t LOW_BITS=0x5555555555555555ULL;   //bit 2i of every base slot
+    static constexpr int N_CODE=4;   //what appendCode() takes for an N
+
+    PackedSequence();
+    //sequence must only hold A, C, G, T or N (either case)
+    explicit PackedSequence(const std::string& sequence);
+    //empty the sequence, keeping the memory it has for the next one
+    void clear();
+    void reserve(int bases);
+    void append(char base);
+    //append a base by its 2-bit code, or N_CODE for an N
+    void appendCode(int c);
+    int length() const;
+    char at(int position) const;
+    void extract(int position, int length, std::string& fragment) const;
+    //the 32 bases starting at position (bases past the end read as 0)
+    uint64_t codes(int position) const;
+    //bit 2i is set if base position+i is an N
+    uint64_t nMask(int position) const;
+    //index of the first base (counted from 0) where the two ranges differ, or length if they agree
+    int firstMismatch(int position, const PackedSequence& other, int otherPosition, int length) const;
+    //like firstMismatch, but step over up to allowed mismatches first (allowed is decremented for each
+    //one used); returns the index of the first mismatch that didn't fit, or length
+    int extendMatch(int position, const PackedSequence& other, int otherPosition, int length, int& allowed) const;
+    //whether any of the length bases from position is an N
+    bool hasN(int position, int length) const;
+    //the words and N runs, for the memory accounting
+    void countBytes(ByteCount& count) const;
+    void save(IndexWriter& writer) const;
+    //the loaded sequence is a view into the reader's file
+    bool load(IndexReader& reader);
+
+    //2-bit code of a base, or -1 for N / anything else
+    static int code(char base)
+    {
+        switch (base)
+        {
+            case 'A': case 'a': return 0;
+            case 'C': case 'c': return 1;
+            case 'G': case 'g': return 2;
+            case 'T': case 't': return 3;
+            default: return -1;
+        }
+    }
+    //collapse an XOR of two code words to one bit (bit 2i) per differing base
+    static uint64_t baseDifferences(uint64_t x)
+    {
+        return (x | (x>>1)) & LOW_BITS;
+    }
+    //index of the lowest differing base in a non-zero difference mask
+    static int firstBase(uint64_t differences)
+    {
+        return __builtin_ctzll(differences)/2;
+    }
+
+private:
+    //a [start,end) range of N
+    struct NRun
+    {
+        int start;
+        int end;
+    };
+    Storage<uint64_t> m_words;
+    Storage<NRun> m_nRuns;   //sorted by start
+    int m_length;
+
+    //the last run starting at or before position (or the first run, if none does)
+    const NRun* runAtOrBefore(int position) const
+    {
+        const NRun* run=std::upper_bound(m_nRuns.begin(), m_nRuns.end(), position,
+                                         [](int p, const NRun& r) { return p<r.start; });
+        if (run!=m_nRuns.begin())
+            --run;
+        return run;
+    }
+    bool isN(int position) const
+    {
+        const NRun* run=runAtOrBefore(position);
+        return run!=m_nRuns.end() && run->start<=position && position<run->end;
+    }
+};
+
+inline PackedSequence::PackedSequence()
+: m_length(0)
+{
+}
+
+inline PackedSequence::PackedSequence(const std::string& sequence)
+: m_length(0)
+{
+    reserve(static_cast<int>(sequence.size()));
+    for (size_t k=0;k<sequence.size();k++)
+        append(sequence[k]);
+}
+
+inline void PackedSequence::clear()
+{
+    m_words.clear();
+    m_nRuns.clear();
+    m_length=0;
+}
+
+inline void PackedSequence::reserve(int bases)
+{
+    m_words.reserve((bases+BASES_PER_WORD-1)/BASES_PER_WORD);
+}
+
+inline void PackedSequence::append(char base)
+{
+    int c=code(base);
+    appendCode(c<0 ? N_CODE : c);
+}
+
+inline void PackedSequence::appendCode(int c)
+{
+    int slot=m_length%BASES_PER_WORD;
+    if (slot==0)
+        m_words.push_back(0);
+    if (c==N_CODE)
+    {
+        //extend the last run if this N continues it
+        if (!m_nRuns.empty() && m_nRuns.back().end==m_length)
+            m_nRuns.back().end++;
+        else
+            m_nRuns.push_back(NRun{m_length, m_length+1});
+        c=0;
+    }
+    m_words.back() |= static_cast<uint64_t>(c)<<(2*slot);
+    m_length++;
+}
+
+inline int PackedSequence::length() const
+{
+    return m_length;
+}
+
+inline char PackedSequence::at(int position) const
+{
+    static const char letters[]="ACGT";
+    if (!m_nRuns.empty() && isN(position))
+        return 'N';
+    return letters[(m_words[position/BASES_PER_WORD]>>(2*(position%BASES_PER_WORD)))&3];
+}
+
+inline void PackedSequence::extract(int position, int length, std::string& fragment) const
+{
+    static const char letters[]="ACGT";
+    fragment.resize(length);
+    //decode a word at a time
+    for (int i=0;i<length;i+=BASES_PER_WORD)
+    {
+        uint64_t word=codes(position+i);
+        int end=std::min(length-i, BASES_PER_WORD);
+        for (int j=0;j<end;j++,word>>=2)
+            fragment[i+j]=letters[word&3];
+    }
+    //then paint the N runs that overlap the range
+    for (const NRun* run=runAtOrBefore(position);run!=m_nRuns.end() && run->start<position+length;++run)
+    {
+        for (int i=std::max(run->start, position);i<std::min(run->end, position+length);i++)
+            fragment[i-position]='N';
+    }
+}
+
+inline uint64_t PackedSequence::codes(int position) const
+{
+    size_t word=position/BASES_PER_WORD;
+    int shift=2*(position%BASES_PER_WORD);
+    if (word>=m_words.size())
+        return 0;
+    uint64_t result=m_words[word]>>shift;
+    //pull the rest of the 32 bases out of the following word
+    if (shift!=0 && word+1<m_words.size())
+        result |= m_words[word+1]<<(64-shift);
+    return result;
+}
+
+inline uint64_t PackedSequence::nMask(int position) const
+{
+    if (m_nRuns.empty())
+        return 0;
+    uint64_t mask=0;
+    int end=position+BASES_PER_WORD;
+    for (const NRun* run=runAtOrBefore(position);run!=m_nRuns.end() && run->start<end;++run)
+    {
+        for (int i=std::max(run->start, position);i<std::min(run->end, end);i++)
+            mask |= 1ULL<<(2*(i-position));
+    }
+    return mask;
+}
+
+inline int PackedSequence::firstMismatch(int position, const PackedSequence& other, int otherPosition, int length) const
+{
+    int allowed=0;
+    return extendMatch(position, other, otherPosition, length, allowed);
+}
+
+inline bool PackedSequence::hasN(int position, int length) const
+{
+    if (m_nRuns.empty())
+        return false;
+    const NRun* run=runAtOrBefore(position);
+    if (run->end<=position)
+        ++run;
+    return run!=m_nRuns.end() && run->start<position+length;
+}
+
+inline int PackedSequence::extendMatch(int position, const PackedSequence& other, int otherPosition, int length, int& allowed) const
+{
+    //Where neither range holds an N, whole words that agree are skipped by the vector kernel (see
+    //MatchKernel.h); that only pays off once there are a few words to compare
+    bool plain=length>=4*BASES_PER_WORD && !hasN(position, length) && !other.hasN(otherPosition, length);
+    //compare 32 bases per step, an N only equals another N
+    for (int i=0;i<length;i+=BASES_PER_WORD)
+    {
+        if (plain)
+        {
+            //the kernel reads a word past the last one it compares
+            size_t word=(position+i)/BASES_PER_WORD, otherWord=(otherPosition+i)/BASES_PER_WORD;
+            int words=(length-i)/BASES_PER_WORD;
+            if (word+1<m_words.size() && otherWord+1<other.m_words.size())
+            {
+                words=static_cast<int>(std::min<size_t>(words, std::min(m_words.size()-word, other.m_words.size()-otherWord)-1));
+                i+=BASES_PER_WORD*equalWords(m_words.data()+word, 2*((position+i)%BASES_PER_WORD),
+                                             other.m_words.data()+otherWord, 2*((otherPosition+i)%BASES_PER_WORD), words);
+                if (i>=length)
+                    break;
+            }
+        }
+        uint64_t differences=baseDifferences(codes(position+i)^other.codes(otherPosition+i));
+        differences |= nMask(position+i)^other.nMask(otherPosition+i);
+        if (length-i<BASES_PER_WORD)
+            differences &= (1ULL<<(2*(length-i)))-1;
+        //one set bit per differing base, use them up lowest first
+        for (;differences!=0;differences&=differences-1)
+        {
+            if (allowed==0)
+                return i+firstBase(differences);
+            allowed--;
+        }
+    }
+    return length;
+}
+
+inline void PackedSequence::countBytes(ByteCount& count) const
+{
+    count.add(m_words);
+    count.add(m_nRuns);
+}
+
+inline void PackedSequence::save(IndexWriter& writer) const
+{
+    writer.write(m_length);
+    writer.writeArray(m_words);
+    writer.writeArray(m_nRuns);
+}
+
+inline bool PackedSequence::load(IndexReader& reader)
+{
+    if (!reader.read(m_length) || !reader.readArray(m_words) || !reader.readArray(m_nRuns))
+        return false;
+    return m_length>=0 && m_words.size()==static_cast<size_t>((m_length+BASES_PER_WORD-1)/BASES_PER_WORD);
+}
+
+#endif // PACKEDSEQUENCE_INCLUDED
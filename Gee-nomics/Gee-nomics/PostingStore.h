@@ -0,0 +1,270 @@
+#ifndef POSTINGSTORE_INCLUDED
+#define POSTINGSTORE_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include "MappedStorage.h"
+
+//Many lists of non-negative ints, each in non-decreasing order, compressed into one byte array.
+//A list is stored as the gaps between its values (the first one as the gap from 0), each gap as a
+//varint: 7 bits per byte, low bits first, the high bit set on every byte but the last. Positions in a
+//genome come in order, so most gaps fit in a byte or two instead of the 4 a plain int takes.
+//Values added with append() wait in a pending list until seal() packs them in; forEach() decodes a
+//sealed list on the fly, nothing is unpacked into memory. Where each list starts is a 64-bit byte offset,
+//so the lists may take more than 4 GiB together.
+class PostingStore
+{
+public:
+    PostingStore();
+    void reset();
+    //an empty list; its id is the number of lists made before it
+    int newList();
+    int lists() const;
+    //value must be at least the last value appended to the list; it can't be seen until seal()
+    void append(int list, int value);
+    bool sealed() const;
+    void seal();
+    //add a whole list of n sorted values at once, already sealed (anything pending is sealed first)
+    int addList(const int* values, size_t n);
+    //calls visit(value) for every sealed value of list, in order
+    template<typename Visitor>
+    void forEach(int list, Visitor visit) const;
+    //how many bytes the compressed lists take
+    size_t bytes() const;
+    //the memory accounting: the sealed lists, and the values still pending
+    void countBytes(ByteCount& lists, ByteCount& pending) const;
+    //append the encoding addList() gives a list of n sorted values to out, for lists built elsewhere
+    static void encodeList(const int* values, size_t n, std::vector<uint8_t>& out);
+    //take over lists encoded one after another into bytes, list i from starts[i] up to starts[i+1];
+    //false, leaving the store empty, if they don't fit together
+    bool assign(Storage<uint8_t> bytes, Storage<uint64_t> starts);
+    //seal() first; a loaded store is a view into the reader's file
+    void save(IndexWriter& writer) const;
+    bool load(IndexReader& reader);
+private:
+    struct Pending
+    {
+        int list;
+        int value;
+    };
+    Storage<uint8_t> m_bytes;
+    Storage<uint64_t> m_starts;   //list i is m_bytes[m_starts[i]..m_starts[i+1]), for the lists sealed so far
+    std::vector<Pending> m_pending;
+    int m_lists;
+
+    static void encode(uint32_t gap, std::vector<uint8_t>& out)
+    {
+        for (;gap>=0x80;gap>>=7)
+            out.push_back(static_cast<uint8_t>(gap|0x80));
+        out.push_back(static_cast<uint8_t>(gap));
+    }
+    static uint32_t decode(const uint8_t*& p)
+    {
+        uint32_t gap=0;
+        for (int shift=0;;shift+=7)
+        {
+            uint8_t b=*p++;
+            gap |= static_cast<uint32_t>(b&0x7f)<<shift;
+            if (!(b&0x80))
+                return gap;
+        }
+    }
+    //whether the sealed lists hold together: starts from 0 up to the end of the bytes, never going back,
+    //and every list ending on the last byte of a gap, so decoding one can't run past it
+    bool valid() const;
+    //give every list made since the last seal an empty range at the end
+    void extendStarts()
+    {
+        while (m_starts.size()<static_cast<size_t>(m_lists)+1)
+            m_starts.push_back(m_bytes.size());
+    }
+};
+
+inline PostingStore::PostingStore()
+{
+    reset();
+}
+
+inline void PostingStore::reset()
+{
+    m_bytes.clear();
+    m_starts.clear();
+    m_starts.push_back(0);
+    m_pending.clear();
+    m_lists=0;
+}
+
+inline int PostingStore::newList()
+{
+    return m_lists++;
+}
+
+inline int PostingStore::lists() const
+{
+    return m_lists;
+}
+
+inline void PostingStore::append(int list, int value)
+{
+    m_pending.push_back(Pending{list, value});
+}
+
+inline bool PostingStore::sealed() const
+{
+    return m_pending.empty() && m_starts.size()==static_cast<size_t>(m_lists)+1;
+}
+
+//Rewrite the byte array once: every list keeps its old bytes as they are, and its pending values are
+//encoded after them as gaps from its last old value.
+inline void PostingStore::seal()
+{
+    if (m_pending.empty())
+    {
+        extendStarts();
+        return;
+    }
+    //group by list with a counting sort, keeping each list's values in the order they came
+    std::vector<uint32_t> first(m_lists+1, 0);
+    for (size_t i=0;i<m_pending.size();i++)
+        first[m_pending[i].list+1]++;
+    for (int list=0;list<m_lists;list++)
+        first[list+1]+=first[list];
+    std::vector<int> grouped(m_pending.size());
+    {
+        std::vector<uint32_t> next(first.begin(), first.end()-1);
+        for (size_t i=0;i<m_pending.size();i++)
+            grouped[next[m_pending[i].list]++]=m_pending[i].value;
+    }
+    m_pending.clear();
+    m_pending.shrink_to_fit();
+    std::vector<uint8_t> bytes;
+    bytes.reserve(m_bytes.size()+grouped.size()*2);
+    std::vector<uint64_t> starts(m_lists+1);
+    size_t oldLists=m_starts.size()-1;
+    for (int list=0;list<m_lists;list++)
+    {
+        starts[list]=bytes.size();
+        uint32_t last=0;
+        if (static_cast<size_t>(list)<oldLists)
+        {
+            const uint8_t* b=m_bytes.begin()+m_starts[list];
+            const uint8_t* end=m_bytes.begin()+m_starts[list+1];
+            bytes.insert(bytes.end(), b, end);
+            while (b<end)
+                last+=decode(b);
+        }
+        for (uint32_t p=first[list];p<first[list+1];p++)
+        {
+            encode(static_cast<uint32_t>(grouped[p])-last, bytes);
+            last=static_cast<uint32_t>(grouped[p]);
+        }
+    }
+    starts[m_lists]=bytes.size();
+    m_bytes=std::move(bytes);
+    m_starts=std::move(starts);
+}
+
+inline int PostingStore::addList(const int* values, size_t n)
+{
+    seal();
+    uint32_t last=0;
+    for (size_t i=0;i<n;i++)
+    {
+        uint32_t gap=static_cast<uint32_t>(values[i])-last;
+        for (;gap>=0x80;gap>>=7)
+            m_bytes.push_back(static_cast<uint8_t>(gap|0x80));
+        m_bytes.push_back(static_cast<uint8_t>(gap));
+        last=static_cast<uint32_t>(values[i]);
+    }
+    m_starts.push_back(m_bytes.size());
+    return m_lists++;
+}
+
+template<typename Visitor>
+void PostingStore::forEach(int list, Visitor visit) const
+{
+    if (static_cast<size_t>(list)+1>=m_starts.size())
+        return;
+    const uint8_t* p=m_bytes.begin()+m_starts[list];
+    const uint8_t* end=m_bytes.begin()+m_starts[list+1];
+    uint32_t value=0;
+    while (p<end)
+    {
+        value+=decode(p);
+        visit(static_cast<int>(value));
+    }
+}
+
+inline size_t PostingStore::bytes() const
+{
+    return m_bytes.size()+m_starts.size()*sizeof(uint64_t);
+}
+
+inline void PostingStore::countBytes(ByteCount& lists, ByteCount& pending) const
+{
+    lists.add(m_bytes);
+    lists.add(m_starts);
+    pending.add(m_pending);
+}
+
+inline void PostingStore::encodeList(const int* values, size_t n, std::vector<uint8_t>& out)
+{
+    uint32_t last=0;
+    for (size_t i=0;i<n;i++)
+    {
+        encode(static_cast<uint32_t>(values[i])-last, out);
+        last=static_cast<uint32_t>(values[i]);
+    }
+}
+
+inline bool PostingStore::assign(Storage<uint8_t> bytes, Storage<uint64_t> starts)
+{
+    reset();
+    m_bytes=std::move(bytes);
+    m_starts=std::move(starts);
+    if (!valid())
+    {
+        reset();
+        return false;
+    }
+    m_lists=static_cast<int>(m_starts.size()-1);
+    return true;
+}
+
+inline bool PostingStore::valid() const
+{
+    //read through the const accessors, so a view stays a view
+    const Storage<uint8_t>& bytes=m_bytes;
+    const Storage<uint64_t>& starts=m_starts;
+    if (starts.empty() || starts.size()-1>static_cast<size_t>(INT_MAX) || starts[0]!=0 || starts.back()!=bytes.size())
+        return false;
+    for (size_t list=0;list+1<starts.size();list++)
+    {
+        if (starts[list+1]<starts[list] || starts[list+1]>bytes.size()
+            || (starts[list+1]>starts[list] && (bytes[starts[list+1]-1]&0x80)))
+            return false;
+    }
+    return true;
+}
+
+inline void PostingStore::save(IndexWriter& writer) const
+{
+    writer.writeArray(m_bytes);
+    writer.writeArray(m_starts);
+}
+
+inline bool PostingStore::load(IndexReader& reader)
+{
+    if (!reader.readArray(m_bytes) || !reader.readArray(m_starts) || !valid())
+    {
+        reset();
+        return false;
+    }
+    m_pending.clear();
+    m_lists=static_cast<int>(m_starts.size()-1);
+    return true;
+}
+
+#endif // POSTINGSTORE_INCLUDED
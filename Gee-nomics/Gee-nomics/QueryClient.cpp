@@ -0,0 +1,495 @@
+//
+//  QueryClient.cpp
+//  Gee-nomics
+//
+//  A client for the query server (main.cpp --listen ...), and a load generator to measure it. It has its
+//  own main(), so build it apart from main.cpp:
+//
+//      g++ -std=c++17 -O2 -pthread QueryClient.cpp Genome.cpp -o queryclient
+//      ./queryclient unix:/tmp/geenomics.sock info
+//      ./queryclient unix:/tmp/geenomics.sock find ACGTACGTACGTAC 12 e
+//      ./queryclient unix:/tmp/geenomics.sock related query.txt 20 s
+//      ./queryclient unix:/tmp/geenomics.sock load --data ../data/Ferroglobus_placidus.txt --connections 4 --depth 32
+//
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include "provided.h"
+#include "QueryProtocol.h"
+using namespace std;
+
+//One connection to a server. The send functions only write the request and return its id, so any number
+//can be in flight at once; receive() hands back responses in the order the server finishes them. The
+//blocking calls (info(), find(), ...) are for when nothing else is in flight.
+class QueryClient
+{
+public:
+    QueryClient()
+    : m_fd(-1), m_nextId(1)
+    {
+    }
+    ~QueryClient()
+    {
+        if (m_fd>=0)
+            ::close(m_fd);
+    }
+    bool connect(const string& address, string& error)
+    {
+        m_fd=connectTo(address, error);
+        return m_fd>=0;
+    }
+    int fd() const
+    {
+        return m_fd;
+    }
+    //the id the next request will get
+    uint32_t nextId() const
+    {
+        return m_nextId;
+    }
+    uint32_t sendInfo()
+    {
+        MessageWriter out(m_nextId, QueryType::Info);
+        return send(out);
+    }
+    uint32_t sendNames(uint32_t first)
+    {
+        MessageWriter out(m_nextId, QueryType::Names);
+        out.write(first);
+        return send(out);
+    }
+    uint32_t sendFind(const string& fragment, int minimumLength, bool exactMatchOnly)
+    {
+        MessageWriter out(m_nextId, QueryType::Find);
+        out.write(static_cast<uint8_t>(exactMatchOnly));
+        out.write(static_cast<int32_t>(minimumLength));
+        out.writeString(fragment);
+        return send(out);
+    }
+    uint32_t sendRelated(const string& sequence, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, int topK)
+    {
+        MessageWriter out(m_nextId, QueryType::Related);
+        out.write(static_cast<uint8_t>(exactMatchOnly));
+        out.write(static_cast<int32_t>(fragmentMatchLength));
+        out.write(matchPercentThreshold);
+        out.write(static_cast<int32_t>(topK));
+        out.writeString(sequence);
+        return send(out);
+    }
+    //the next response; body is left just past its QueryStatus
+    bool receive(FrameHeader& header, QueryStatus& status, vector<char>& body)
+    {
+        if (!receiveFrame(m_fd, header, body) || body.empty())
+            return false;
+        status=static_cast<QueryStatus>(static_cast<uint8_t>(body[0]));
+        body.erase(body.begin());
+        return true;
+    }
+    bool info(int& minSearchLength, int& genomeCount)
+    {
+        vector<char> body;
+        if (!call(sendInfo(), body))
+            return false;
+        MessageReader in(body.data(), body.size());
+        int32_t length, count;
+        if (!in.read(length) || !in.read(count))
+            return false;
+        minSearchLength=length;
+        genomeCount=count;
+        return true;
+    }
+    //the name of genome id, fetching the names the client hasn't seen yet the first time it needs one
+    bool name(int id, string& genomeName)
+    {
+        if (id>=0 && static_cast<size_t>(id)>=m_names.size())
+        {
+            vector<char> body;
+            if (!call(sendNames(static_cast<uint32_t>(m_names.size())), body))
+                return false;
+            MessageReader in(body.data(), body.size());
+            uint32_t n;
+            if (!in.read(n))
+                return false;
+            for (uint32_t k=0;k<n;k++)
+            {
+                string s;
+                if (!in.readString(s))
+                    return false;
+                m_names.push_back(s);
+            }
+        }
+        if (id<0 || static_cast<size_t>(id)>=m_names.size())
+            return false;
+        genomeName=m_names[id];
+        return true;
+    }
+    bool find(const string& fragment, int minimumLength, bool exactMatchOnly, vector<DNAMatch>& matches)
+    {
+        vector<char> body;
+        if (!call(sendFind(fragment, minimumLength, exactMatchOnly), body))
+            return false;
+        MessageReader in(body.data(), body.size());
+        uint8_t found;
+        uint32_t n;
+        if (!in.read(found) || !in.read(n))
+            return false;
+        vector<DNAMatchId> ids(n);
+        for (uint32_t k=0;k<n;k++)
+        {
+            int32_t id, length, position;
+            if (!in.read(id) || !in.read(length) || !in.read(position))
+                return false;
+            ids[k]=DNAMatchId{id, length, position};
+        }
+        for (const auto& m : ids)
+        {
+            DNAMatch match;
+            if (!name(m.genomeId, match.genomeName))
+                return false;
+            match.length=m.length;
+            match.position=m.position;
+            matches.push_back(match);
+        }
+        return found!=0;
+    }
+    //parse the body of a Related response
+    static bool readRelated(const vector<char>& body, vector<GenomeMatchId>& results)
+    {
+        MessageReader in(body.data(), body.size());
+        uint8_t found;
+        uint32_t n;
+        if (!in.read(found) || !in.read(n))
+            return false;
+        for (uint32_t k=0;k<n;k++)
+        {
+            int32_t id;
+            double percent;
+            if (!in.read(id) || !in.read(percent))
+                return false;
+            results.push_back(GenomeMatchId{id, percent});
+        }
+        return true;
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    QueryClient(const QueryClient&) = delete;
+    QueryClient& operator=(const QueryClient&) = delete;
+private:
+    int m_fd;
+    uint32_t m_nextId;
+    vector<string> m_names;   //the names of ids 0 to m_names.size()-1, as far as they've been fetched
+
+    uint32_t send(MessageWriter& out)
+    {
+        const vector<char>& frame=out.finish();
+        if (!sendAll(m_fd, frame.data(), frame.size()))
+            return 0;
+        return m_nextId++;
+    }
+    //wait for the response to request id, which must be the only one in flight
+    bool call(uint32_t id, vector<char>& body)
+    {
+        FrameHeader header;
+        QueryStatus status;
+        return id!=0 && receive(header, status, body) && header.requestId==id && status==QueryStatus::Ok;
+    }
+};
+
+struct LoadSettings
+{
+    string dataFile;           //genomes to cut the queries from; random bases if empty
+    int connections = 4;
+    int depth = 32;            //requests each connection keeps in flight
+    double seconds = 5;
+    int length = 0;            //fragment length, 0 for twice minSearchLength
+    bool exactMatchOnly = true;
+    bool related = false;      //send findRelatedGenomes queries of queryLength bases instead
+    int queryLength = 10000;
+};
+
+//Each connection has a thread keeping depth requests in flight and a thread reading the responses, for
+//settings.seconds. Reports the throughput and the latency of a request from send to response.
+int runLoad(const string& address, const LoadSettings& settings)
+{
+    QueryClient probe;
+    string error;
+    int minSearchLength, genomeCount;
+    if (!probe.connect(address, error) || !probe.info(minSearchLength, genomeCount))
+    {
+        cerr << "Cannot reach " << address << ": " << error << endl;
+        return 1;
+    }
+    int length=settings.related ? settings.queryLength : (settings.length>0 ? settings.length : 2*minSearchLength);
+    mt19937 rng(17);
+    vector<Genome> source;
+    if (!settings.dataFile.empty())
+    {
+        ifstream in(settings.dataFile);
+        if (!in || !Genome::load(in, source))
+        {
+            cerr << "Cannot load " << settings.dataFile << endl;
+            return 1;
+        }
+    }
+    //a pool of queries chosen up front, so making them isn't part of what's measured
+    vector<string> queries;
+    for (int q=0;q<4096;q++)
+    {
+        string fragment;
+        const Genome* g=source.empty() ? nullptr : &source[rng()%source.size()];
+        if (g!=nullptr && g->length()>=length)
+            g->extract(rng()%(g->length()-length+1), length, fragment);
+        else
+        {
+            for (int i=0;i<length;i++)
+                fragment+="ACGT"[rng()%4];
+        }
+        //one SNiP, never in the first base
+        if (!settings.exactMatchOnly && !settings.related && length>1)
+            fragment[1+rng()%(length-1)]="ACGT"[rng()%4];
+        queries.push_back(fragment);
+    }
+    typedef chrono::steady_clock Clock;
+    Clock::time_point start=Clock::now();
+    Clock::time_point deadline=start+chrono::duration_cast<Clock::duration>(chrono::duration<double>(settings.seconds));
+    vector<vector<double>> latencies(settings.connections);
+    atomic<long long> failures(0);
+    vector<thread> threads;
+    for (int c=0;c<settings.connections;c++)
+    {
+        threads.push_back(thread([&, c]()
+        {
+            QueryClient client;
+            string connectError;
+            if (!client.connect(address, connectError))
+            {
+                failures++;
+                return;
+            }
+            mutex m;
+            condition_variable ready;
+            int inFlight=0;
+            bool done=false;
+            unordered_map<uint32_t, Clock::time_point> sent;
+            thread reader([&]()
+            {
+                FrameHeader header;
+                QueryStatus status;
+                vector<char> body;
+                while (client.receive(header, status, body))
+                {
+                    Clock::time_point now=Clock::now();
+                    lock_guard<mutex> lock(m);
+                    auto request=sent.find(header.requestId);
+                    if (request!=sent.end())
+                    {
+                        latencies[c].push_back(chrono::duration<double>(now-request->second).count());
+                        sent.erase(request);
+                    }
+                    if (status!=QueryStatus::Ok)
+                        failures++;
+                    inFlight--;
+                    ready.notify_all();
+                }
+            });
+            mt19937 pick(c);
+            while (Clock::now()<deadline)
+            {
+                {
+                    unique_lock<mutex> lock(m);
+                    ready.wait(lock, [&]() { return inFlight<settings.depth; });
+                    //recorded ahead of the send, so the response can't come back first; the lock isn't held
+                    //while sending, or a full socket each way could leave both ends waiting on the other
+                    sent[client.nextId()]=Clock::now();
+                    inFlight++;
+                }
+                const string& query=queries[pick()%queries.size()];
+                uint32_t id;
+                if (settings.related)
+                    id=client.sendRelated(query, 2*minSearchLength, settings.exactMatchOnly, 10, 10);
+                else
+                    id=client.sendFind(query, minSearchLength, settings.exactMatchOnly);
+                if (id==0)
+                {
+                    lock_guard<mutex> lock(m);
+                    inFlight--;
+                    failures++;
+                    break;
+                }
+            }
+            {
+                unique_lock<mutex> lock(m);
+                done=ready.wait_for(lock, chrono::seconds(30), [&]() { return inFlight<=0; });
+            }
+            if (!done)
+                failures++;
+            //wakes the reader out of its receive
+            ::shutdown(client.fd(), SHUT_RDWR);
+            reader.join();
+        }));
+    }
+    for (auto& t : threads)
+        t.join();
+    double elapsed=chrono::duration<double>(Clock::now()-start).count();
+    vector<double> all;
+    for (const auto& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    sort(all.begin(), all.end());
+    auto percentile=[&all](double p) { return all.empty() ? 0 : all[min(all.size()-1, static_cast<size_t>(p*all.size()))]*1000; };
+    cout << "requests " << all.size() << " in " << fixed << setprecision(2) << elapsed << "s, "
+         << all.size()/elapsed << " per second, " << failures << " failures" << endl;
+    cout << "latency ms: p50 " << setprecision(3) << percentile(0.5) << " p90 " << percentile(0.9)
+         << " p99 " << percentile(0.99) << " max " << percentile(1.0) << endl;
+    return failures==0 ? 0 : 1;
+}
+
+void usage()
+{
+    cerr << "usage: queryclient ADDRESS info" << endl
+         << "       queryclient ADDRESS find FRAGMENT MINLENGTH e|s" << endl
+         << "       queryclient ADDRESS related FILE PERCENT e|s [TOPK]" << endl
+         << "       queryclient ADDRESS load [--data FILE] [--connections N] [--depth N] [--seconds S]" << endl
+         << "                               [--length N] [--snp] [--related] [--query-length N]" << endl
+         << "ADDRESS is unix:PATH, HOST:PORT or PORT" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc<3)
+    {
+        usage();
+        return 1;
+    }
+    string address=argv[1], command=argv[2];
+    if (command=="load")
+    {
+        LoadSettings settings;
+        for (int i=3;i<argc;i++)
+        {
+            string arg=argv[i];
+            if (arg=="--snp")
+                settings.exactMatchOnly=false;
+            else if (arg=="--related")
+                settings.related=true;
+            else if (i+1<argc && arg=="--data")
+                settings.dataFile=argv[++i];
+            else if (i+1<argc && arg=="--connections")
+                settings.connections=max(1, atoi(argv[++i]));
+            else if (i+1<argc && arg=="--depth")
+                settings.depth=max(1, atoi(argv[++i]));
+            else if (i+1<argc && arg=="--seconds")
+                settings.seconds=atof(argv[++i]);
+            else if (i+1<argc && arg=="--length")
+                settings.length=atoi(argv[++i]);
+            else if (i+1<argc && arg=="--query-length")
+                settings.queryLength=max(1, atoi(argv[++i]));
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+        return runLoad(address, settings);
+    }
+    QueryClient client;
+    string error;
+    if (!client.connect(address, error))
+    {
+        cerr << "Cannot connect to " << address << ": " << error << endl;
+        return 1;
+    }
+    if (command=="info" && argc==3)
+    {
+        int minSearchLength, genomeCount;
+        if (!client.info(minSearchLength, genomeCount))
+        {
+            cerr << "No answer from " << address << endl;
+            return 1;
+        }
+        cout << genomeCount << " genomes, minSearchLength " << minSearchLength << endl;
+        return 0;
+    }
+    if (command=="find" && argc==6)
+    {
+        vector<DNAMatch> matches;
+        bool exact=(argv[5][0]=='e');
+        if (!client.find(argv[3], atoi(argv[4]), exact, matches))
+        {
+            cout << "No matches of " << argv[3] << " were found." << endl;
+            return 0;
+        }
+        for (const auto& m : matches)
+            cout << "  length " << m.length << " position " << m.position << " in " << m.genomeName << endl;
+        return 0;
+    }
+    if (command=="related" && (argc==6 || argc==7))
+    {
+        ifstream in(argv[3]);
+        vector<Genome> genomes;
+        if (!in || !Genome::load(in, genomes))
+        {
+            cerr << "Cannot load " << argv[3] << endl;
+            return 1;
+        }
+        int minSearchLength, genomeCount;
+        if (!client.info(minSearchLength, genomeCount))
+        {
+            cerr << "No answer from " << address << endl;
+            return 1;
+        }
+        //every query goes out at once, and the answers are put back in file order
+        vector<uint32_t> ids;
+        for (const auto& g : genomes)
+        {
+            string sequence;
+            g.extract(0, g.length(), sequence);
+            ids.push_back(client.sendRelated(sequence, 2*minSearchLength, argv[5][0]=='e', atof(argv[4]), argc==7 ? atoi(argv[6]) : 0));
+        }
+        unordered_map<uint32_t, vector<GenomeMatchId>> answers;
+        for (size_t k=0;k<ids.size();k++)
+        {
+            FrameHeader header;
+            QueryStatus status;
+            vector<char> body;
+            if (!client.receive(header, status, body) || status!=QueryStatus::Ok || !QueryClient::readRelated(body, answers[header.requestId]))
+            {
+                cerr << "Bad answer from " << address << endl;
+                return 1;
+            }
+        }
+        cout.setf(ios::fixed);
+        cout.precision(2);
+        for (size_t k=0;k<genomes.size();k++)
+        {
+            const vector<GenomeMatchId>& matches=answers[ids[k]];
+            cout << "  For " << genomes[k].name() << endl;
+            if (matches.empty())
+            {
+                cout << "    No related genomes were found" << endl;
+                continue;
+            }
+            cout << "    " << matches.size() << " related genomes were found:" << endl;
+            for (const auto& m : matches)
+            {
+                string name;
+                client.name(m.genomeId, name);
+                cout << "     " << setw(6) << m.percentMatch << "%  " << name << endl;
+            }
+        }
+        return 0;
+    }
+    usage();
+    return 1;
+}
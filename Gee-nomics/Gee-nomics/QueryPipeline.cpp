@@ -0,0 +1,83 @@
+#include "QueryPipeline.h"
+#include "SequenceReader.h"
+#include "BoundedQueue.h"
+#include "ThreadPool.h"
+#include <memory>
+#include <future>
+#include <thread>
+#include <string>
+#include <vector>
+using namespace std;
+
+//some consecutive records and, once a worker is done with them, their matches
+struct QueryChunk
+{
+    vector<Genome> queries;
+    vector<vector<GenomeMatch>> matches;
+    promise<void> matched;
+};
+
+//The parser puts every chunk in two queues: work, which the workers take chunks from in any order, and
+//ordered, which the calling thread reports them from in input order, waiting for each to be matched. A
+//chunk stays in ordered until it is reported, so ordered's capacity is the limit on chunks in flight.
+bool streamRelatedGenomes(const GenomeMatcher& library, istream& queries, const QueryStreamOptions& options,
+                          const function<void(const Genome& query, const vector<GenomeMatch>& matches)>& report,
+                          string& error)
+{
+    int workers=(options.workers>0) ? options.workers : ThreadPool::hardwareThreads();
+    int inFlight=(options.chunksInFlight>0) ? options.chunksInFlight : 2*workers;
+    BoundedQueue<shared_ptr<QueryChunk>> work(inFlight);
+    BoundedQueue<shared_ptr<QueryChunk>> ordered(inFlight);
+    string parseError;
+    thread parser([&]()
+    {
+        SequenceReader reader(queries);
+        for (bool more=true;more;)
+        {
+            shared_ptr<QueryChunk> chunk=make_shared<QueryChunk>();
+            long long bases=0;
+            while (static_cast<int>(chunk->queries.size())<options.chunkRecords && bases<options.chunkBases)
+            {
+                if (!reader.next(chunk->queries))
+                {
+                    more=false;
+                    break;
+                }
+                bases+=chunk->queries.back().length();
+            }
+            if (!chunk->queries.empty() && (!ordered.push(chunk) || !work.push(chunk)))
+                break;
+        }
+        parseError=reader.error();
+        work.close();
+        ordered.close();
+    });
+    {
+        //the pool's destructor waits for the workers to drain work
+        ThreadPool pool(workers);
+        for (int w=0;w<workers;w++)
+        {
+            pool.submit([&]()
+            {
+                shared_ptr<QueryChunk> chunk;
+                while (work.pop(chunk))
+                {
+                    chunk->matches.resize(chunk->queries.size());
+                    for (size_t k=0;k<chunk->queries.size();k++)
+                        library.findRelatedGenomes(chunk->queries[k], options.fragmentMatchLength, options.exactMatchOnly, options.matchPercentThreshold, chunk->matches[k], options.related);
+                    chunk->matched.set_value();
+                }
+            });
+        }
+        shared_ptr<QueryChunk> chunk;
+        while (ordered.pop(chunk))
+        {
+            chunk->matched.get_future().wait();
+            for (size_t k=0;k<chunk->queries.size();k++)
+                report(chunk->queries[k], chunk->matches[k]);
+        }
+    }
+    parser.join();
+    error=parseError;
+    return error.empty();
+}
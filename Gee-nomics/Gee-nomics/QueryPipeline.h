@@ -0,0 +1,36 @@
+#ifndef QUERYPIPELINE_INCLUDED
+#define QUERYPIPELINE_INCLUDED
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <functional>
+#include "provided.h"
+
+struct QueryStreamOptions
+{
+    //what findRelatedGenomes is called with for every record
+    int fragmentMatchLength = 0;
+    bool exactMatchOnly = true;
+    double matchPercentThreshold = 0;
+    RelatedGenomesOptions related;
+    //threads matching records, 0 for every hardware thread
+    int workers = 0;
+    //records are passed between the stages in chunks of up to this many records or bases, whichever is first
+    int chunkRecords = 1024;
+    long long chunkBases = 1<<22;
+    //chunks read but not yet reported, 0 for twice the workers; this is what bounds the memory used
+    int chunksInFlight = 0;
+};
+
+//Run findRelatedGenomes for every FASTA or FASTQ record in queries (see SequenceReader.h), as a pipeline:
+//one thread parses the input chunk by chunk, the workers match chunks side by side, and the calling thread
+//hands each record and its matches to report in input order while later chunks are still being parsed and
+//matched. Bounded queues between the stages keep at most chunksInFlight chunks in memory, however large the
+//input. Returns false with the reason in error if the input stops being valid FASTA or FASTQ; every record
+//before that is still reported.
+bool streamRelatedGenomes(const GenomeMatcher& library, std::istream& queries, const QueryStreamOptions& options,
+                          const std::function<void(const Genome& query, const std::vector<GenomeMatch>& matches)>& report,
+                          std::string& error);
+
+#endif // QUERYPIPELINE_INCLUDED
@@ -0,0 +1,316 @@
+#ifndef QUERYPROTOCOL_INCLUDED
+#define QUERYPROTOCOL_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <type_traits>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//The wire format between QueryServer and its clients. Both ends run on one machine, so numbers go in
+//native byte order with no padding. Every message is a frame:
+//
+//    uint32 size        bytes in the rest of the frame
+//    uint32 requestId   chosen by the client, echoed in the response
+//    uint8  type        a QueryType
+//    ...                the body
+//
+//A client may send any number of requests without waiting; the server answers each as soon as it is
+//done, so responses can come back in a different order and are matched up by requestId.
+//
+//Request bodies (a string is a uint32 length and its bytes):
+//    Info        nothing
+//    Names       uint32 firstId
+//    Find        uint8 exactMatchOnly, int32 minimumLength, string fragment
+//    Related     uint8 exactMatchOnly, int32 fragmentMatchLength, double matchPercentThreshold,
+//                int32 topK, string sequence (not empty, and only ACGTN in either case)
+//Response bodies, after a uint8 QueryStatus (nothing else follows unless it is Ok):
+//    Info        int32 minSearchLength, int32 genomeCount
+//    Names       uint32 count, then count strings: the names of ids firstId, firstId+1, ...
+//    Find        uint8 found, uint32 count, then count of (int32 genomeId, int32 length, int32 position)
+//    Related     uint8 found, uint32 count, then count of (int32 genomeId, double percentMatch)
+//Results name genomes by id, which a client turns into names with Names (once, then from a cache).
+enum class QueryType : uint8_t
+{
+    Info=1,
+    Names=2,
+    Find=3,
+    Related=4
+};
+
+enum class QueryStatus : uint8_t
+{
+    Ok=0,
+    BadRequest=1    //an unknown type, a body that doesn't parse, or a Related sequence that isn't bases
+};
+
+//frames larger than this are refused rather than buffered
+const uint32_t MAX_FRAME_SIZE=256*1024*1024;
+
+//Builds one frame's bytes; finish() fills in the size.
+class MessageWriter
+{
+public:
+    MessageWriter(uint32_t requestId, QueryType type)
+    {
+        write(uint32_t(0));
+        write(requestId);
+        write(type);
+    }
+    template<typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be written");
+        const char* p=reinterpret_cast<const char*>(&value);
+        m_bytes.insert(m_bytes.end(), p, p+sizeof(T));
+    }
+    void writeString(const std::string& s)
+    {
+        write(static_cast<uint32_t>(s.size()));
+        m_bytes.insert(m_bytes.end(), s.begin(), s.end());
+    }
+    const std::vector<char>& finish()
+    {
+        uint32_t size=static_cast<uint32_t>(m_bytes.size()-sizeof(uint32_t));
+        std::memcpy(m_bytes.data(), &size, sizeof(size));
+        return m_bytes;
+    }
+private:
+    std::vector<char> m_bytes;
+};
+
+//Reads one frame's body back. Every read is bounds checked and returns false past the end.
+class MessageReader
+{
+public:
+    MessageReader(const char* data, size_t size)
+    : m_data(data), m_size(size), m_offset(0)
+    {
+    }
+    template<typename T>
+    bool read(T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be read");
+        if (m_size-m_offset<sizeof(T))
+            return false;
+        std::memcpy(&value, m_data+m_offset, sizeof(T));
+        m_offset+=sizeof(T);
+        return true;
+    }
+    bool readString(std::string& s)
+    {
+        uint32_t n;
+        if (!read(n) || m_size-m_offset<n)
+            return false;
+        s.assign(m_data+m_offset, n);
+        m_offset+=n;
+        return true;
+    }
+    bool atEnd() const
+    {
+        return m_offset==m_size;
+    }
+private:
+    const char* m_data;
+    size_t m_size;
+    size_t m_offset;
+};
+
+//the parts of a frame ahead of its body
+struct FrameHeader
+{
+    uint32_t requestId;
+    QueryType type;
+};
+
+//Send all n bytes, false if the connection is gone. MSG_NOSIGNAL keeps a closed peer from raising SIGPIPE.
+inline bool sendAll(int fd, const char* data, size_t n)
+{
+    while (n>0)
+    {
+        ssize_t sent=::send(fd, data, n, MSG_NOSIGNAL);
+        if (sent<0 && errno==EINTR)
+            continue;
+        if (sent<=0)
+            return false;
+        data+=sent;
+        n-=sent;
+    }
+    return true;
+}
+
+inline bool receiveAll(int fd, char* data, size_t n)
+{
+    while (n>0)
+    {
+        ssize_t got=::recv(fd, data, n, 0);
+        if (got<0 && errno==EINTR)
+            continue;
+        if (got<=0)
+            return false;
+        data+=got;
+        n-=got;
+    }
+    return true;
+}
+
+//Read the next frame: its header, and its body into body. False at the end of the connection or on a
+//frame that is too small or too large to be valid.
+inline bool receiveFrame(int fd, FrameHeader& header, std::vector<char>& body)
+{
+    uint32_t size;
+    if (!receiveAll(fd, reinterpret_cast<char*>(&size), sizeof(size)))
+        return false;
+    const uint32_t headerSize=sizeof(uint32_t)+sizeof(uint8_t);
+    if (size<headerSize || size>MAX_FRAME_SIZE)
+        return false;
+    body.resize(size);
+    if (!receiveAll(fd, body.data(), size))
+        return false;
+    std::memcpy(&header.requestId, body.data(), sizeof(uint32_t));
+    header.type=static_cast<QueryType>(static_cast<uint8_t>(body[sizeof(uint32_t)]));
+    body.erase(body.begin(), body.begin()+headerSize);
+    return true;
+}
+
+//An address is "unix:PATH" for a Unix-domain socket, or "HOST:PORT" (or just "PORT", meaning
+//localhost) for TCP.
+inline bool splitHostPort(const std::string& address, std::string& host, std::string& port)
+{
+    size_t colon=address.rfind(':');
+    host=(colon==std::string::npos) ? "127.0.0.1" : address.substr(0, colon);
+    port=(colon==std::string::npos) ? address : address.substr(colon+1);
+    return !port.empty() && port.find_first_not_of("0123456789")==std::string::npos;
+}
+
+inline bool unixAddress(const std::string& address, sockaddr_un& where)
+{
+    std::string path=address.substr(5);
+    if (path.empty() || path.size()>=sizeof(where.sun_path))
+        return false;
+    std::memset(&where, 0, sizeof(where));
+    where.sun_family=AF_UNIX;
+    std::memcpy(where.sun_path, path.c_str(), path.size()+1);
+    return true;
+}
+
+//a listening socket, or -1 with the reason in error
+inline int listenOn(const std::string& address, std::string& error)
+{
+    int fd=-1;
+    if (address.compare(0, 5, "unix:")==0)
+    {
+        sockaddr_un where;
+        if (!unixAddress(address, where))
+        {
+            error="bad socket path";
+            return -1;
+        }
+        //a socket file left by an earlier server would make bind fail
+        ::unlink(where.sun_path);
+        fd=::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd>=0 && ::bind(fd, reinterpret_cast<sockaddr*>(&where), sizeof(where))!=0)
+        {
+            ::close(fd);
+            fd=-1;
+        }
+    }
+    else
+    {
+        std::string host, port;
+        addrinfo hints, *found;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family=AF_UNSPEC;
+        hints.ai_socktype=SOCK_STREAM;
+        if (!splitHostPort(address, host, port) || ::getaddrinfo(host.c_str(), port.c_str(), &hints, &found)!=0)
+        {
+            error="bad address";
+            return -1;
+        }
+        for (addrinfo* a=found;a!=nullptr && fd<0;a=a->ai_next)
+        {
+            fd=::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd<0)
+                continue;
+            int on=1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (::bind(fd, a->ai_addr, a->ai_addrlen)!=0)
+            {
+                ::close(fd);
+                fd=-1;
+            }
+        }
+        ::freeaddrinfo(found);
+    }
+    if (fd<0 || ::listen(fd, 64)!=0)
+    {
+        error=std::strerror(errno);
+        if (fd>=0)
+            ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//a connected socket, or -1 with the reason in error
+inline int connectTo(const std::string& address, std::string& error)
+{
+    int fd=-1;
+    if (address.compare(0, 5, "unix:")==0)
+    {
+        sockaddr_un where;
+        if (!unixAddress(address, where))
+        {
+            error="bad socket path";
+            return -1;
+        }
+        fd=::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd>=0 && ::connect(fd, reinterpret_cast<sockaddr*>(&where), sizeof(where))!=0)
+        {
+            ::close(fd);
+            fd=-1;
+        }
+    }
+    else
+    {
+        std::string host, port;
+        addrinfo hints, *found;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family=AF_UNSPEC;
+        hints.ai_socktype=SOCK_STREAM;
+        if (!splitHostPort(address, host, port) || ::getaddrinfo(host.c_str(), port.c_str(), &hints, &found)!=0)
+        {
+            error="bad address";
+            return -1;
+        }
+        for (addrinfo* a=found;a!=nullptr && fd<0;a=a->ai_next)
+        {
+            fd=::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd>=0 && ::connect(fd, a->ai_addr, a->ai_addrlen)!=0)
+            {
+                ::close(fd);
+                fd=-1;
+            }
+        }
+        ::freeaddrinfo(found);
+        //requests are small and pipelined, so don't let Nagle hold them back
+        if (fd>=0)
+        {
+            int on=1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+    }
+    if (fd<0)
+        error=std::strerror(errno);
+    return fd;
+}
+
+#endif // QUERYPROTOCOL_INCLUDED
@@ -0,0 +1,336 @@
+#include "QueryServer.h"
+#include "QueryProtocol.h"
+#include "ThreadPool.h"
+#include "provided.h"
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+using namespace std;
+
+//One client. Its reader and writer threads and the workers answering its requests share it; the socket
+//is closed when the last of them lets go. Workers only queue their responses, and the writer is the one
+//to block on a client that is slow to read them.
+struct Connection
+{
+    int fd;
+    //requests read but not yet answered and sent; the reader stops reading at MAX_IN_FLIGHT, so a client
+    //that pipelines faster than it reads the answers is held back by the socket rather than by memory
+    mutex queueMutex;
+    condition_variable answered;      //inFlight went down
+    condition_variable ready;         //a response was queued, or the reader stopped
+    int inFlight;
+    deque<vector<char>> responses;    //answered, waiting for the writer
+    bool reading;                     //the reader is still going
+    atomic<bool> finished;            //the reader and the writer are both done with it
+
+    explicit Connection(int fd)
+    : fd(fd), inFlight(0), reading(true), finished(false)
+    {
+    }
+    ~Connection()
+    {
+        ::close(fd);
+    }
+};
+
+class QueryServerImpl
+{
+public:
+    QueryServerImpl(const GenomeMatcher& library, int threads);
+    ~QueryServerImpl();
+    bool listen(const string& address, string& error);
+    void run();
+    void stop();
+private:
+    static const int MAX_IN_FLIGHT=64;
+    //a client that takes no response for this long is dropped
+    static const int SEND_TIMEOUT_SECONDS=30;
+    const GenomeMatcher& m_library;
+    ThreadPool m_pool;
+    int m_listener;
+    string m_socketPath;   //a Unix-domain socket's file, removed when the server stops
+    atomic<bool> m_stopping;
+    //every connection with its threads; finished ones are joined on the next accept
+    struct Reader
+    {
+        shared_ptr<Connection> connection;
+        thread reader;
+        thread writer;
+    };
+    list<Reader> m_readers;
+
+    //read requests off the connection until it closes, handing each to the pool
+    void readRequests(shared_ptr<Connection> connection);
+    //send the responses the workers queue, until the reader has stopped and every one is sent
+    void writeResponses(shared_ptr<Connection> connection);
+    //answer one request and queue the response
+    void answer(Connection& connection, const FrameHeader& header, const vector<char>& body) const;
+    //the body of the response to a request, false if the request doesn't parse
+    bool respond(QueryType type, MessageReader& in, MessageWriter& out) const;
+    void reapReaders(bool all);
+};
+
+QueryServerImpl::QueryServerImpl(const GenomeMatcher& library, int threads)
+: m_library(library), m_pool(threads>0 ? threads : ThreadPool::hardwareThreads()), m_listener(-1), m_stopping(false)
+{
+}
+
+QueryServerImpl::~QueryServerImpl()
+{
+    stop();
+    reapReaders(true);
+    if (m_listener>=0)
+        ::close(m_listener);
+    if (!m_socketPath.empty())
+        ::unlink(m_socketPath.c_str());
+}
+
+bool QueryServerImpl::listen(const string& address, string& error)
+{
+    m_listener=listenOn(address, error);
+    if (m_listener<0)
+        return false;
+    if (address.compare(0, 5, "unix:")==0)
+        m_socketPath=address.substr(5);
+    return true;
+}
+
+void QueryServerImpl::run()
+{
+    while (!m_stopping)
+    {
+        int fd=::accept(m_listener, nullptr, nullptr);
+        if (fd<0)
+        {
+            if (errno==EINTR || errno==ECONNABORTED)
+                continue;
+            break;
+        }
+        int on=1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        timeval timeout{SEND_TIMEOUT_SECONDS, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        reapReaders(false);
+        shared_ptr<Connection> connection=make_shared<Connection>(fd);
+        m_readers.push_back(Reader{connection, thread(&QueryServerImpl::readRequests, this, connection),
+                                   thread(&QueryServerImpl::writeResponses, this, connection)});
+    }
+    reapReaders(true);
+}
+
+//Only touches an atomic and the listening socket, so a signal handler can call it.
+void QueryServerImpl::stop()
+{
+    m_stopping=true;
+    if (m_listener>=0)
+        ::shutdown(m_listener, SHUT_RDWR);
+}
+
+//Join the readers that are done, or with all set, stop the rest from reading and join every one.
+void QueryServerImpl::reapReaders(bool all)
+{
+    for (auto r=m_readers.begin();r!=m_readers.end();)
+    {
+        if (!all && !r->connection->finished)
+        {
+            r++;
+            continue;
+        }
+        //the requests already read are still answered
+        if (all)
+            ::shutdown(r->connection->fd, SHUT_RD);
+        r->reader.join();
+        r->writer.join();
+        r=m_readers.erase(r);
+    }
+}
+
+void QueryServerImpl::readRequests(shared_ptr<Connection> connection)
+{
+    FrameHeader header;
+    vector<char> body;
+    while (!m_stopping && receiveFrame(connection->fd, header, body))
+    {
+        {
+            unique_lock<mutex> lock(connection->queueMutex);
+            connection->answered.wait(lock, [&]() { return connection->inFlight<MAX_IN_FLIGHT; });
+            connection->inFlight++;
+        }
+        //the task owns its copy of the request and a hold on the connection
+        m_pool.submit([this, connection, header, request=move(body)]()
+        {
+            answer(*connection, header, request);
+        });
+        body=vector<char>();
+    }
+    lock_guard<mutex> lock(connection->queueMutex);
+    connection->reading=false;
+    connection->ready.notify_one();
+}
+
+void QueryServerImpl::writeResponses(shared_ptr<Connection> connection)
+{
+    bool broken=false;
+    unique_lock<mutex> lock(connection->queueMutex);
+    for (;;)
+    {
+        connection->ready.wait(lock, [&]() { return !connection->responses.empty() || (!connection->reading && connection->inFlight==0); });
+        if (connection->responses.empty())
+            break;
+        vector<char> frame=move(connection->responses.front());
+        connection->responses.pop_front();
+        lock.unlock();
+        //a client that has gone away, or stopped reading, just stops getting answers; the rest are
+        //dropped as they come, and its reader sees the end of the socket
+        if (!broken && !sendAll(connection->fd, frame.data(), frame.size()))
+        {
+            broken=true;
+            ::shutdown(connection->fd, SHUT_RDWR);
+        }
+        lock.lock();
+        connection->inFlight--;
+        connection->answered.notify_one();
+    }
+    connection->finished=true;
+}
+
+void QueryServerImpl::answer(Connection& connection, const FrameHeader& header, const vector<char>& body) const
+{
+    MessageReader in(body.data(), body.size());
+    MessageWriter out(header.requestId, header.type);
+    out.write(QueryStatus::Ok);
+    if (!respond(header.type, in, out))
+    {
+        out=MessageWriter(header.requestId, header.type);
+        out.write(QueryStatus::BadRequest);
+    }
+    const vector<char>& frame=out.finish();
+    lock_guard<mutex> lock(connection.queueMutex);
+    connection.responses.push_back(frame);
+    connection.ready.notify_one();
+}
+
+//Genome would quietly turn any other byte into an N that still counts toward percentMatch, so a client
+//sending the wrong encoding would get scores that look right
+static bool isBases(const string& sequence)
+{
+    if (sequence.empty())
+        return false;
+    for (size_t i=0;i<sequence.size();i++)
+    {
+        switch (sequence[i])
+        {
+            case 'A': case 'C': case 'G': case 'T': case 'N':
+            case 'a': case 'c': case 'g': case 't': case 'n':
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+bool QueryServerImpl::respond(QueryType type, MessageReader& in, MessageWriter& out) const
+{
+    switch (type)
+    {
+        case QueryType::Info:
+        {
+            if (!in.atEnd())
+                return false;
+            out.write(static_cast<int32_t>(m_library.minimumSearchLength()));
+            out.write(static_cast<int32_t>(m_library.genomeCount()));
+            return true;
+        }
+        case QueryType::Names:
+        {
+            uint32_t first;
+            if (!in.read(first) || !in.atEnd())
+                return false;
+            int count=m_library.genomeCount();
+            uint32_t n=(first<static_cast<uint32_t>(count)) ? count-first : 0;
+            out.write(n);
+            for (uint32_t k=0;k<n;k++)
+                out.writeString(m_library.genomeName(first+k));
+            return true;
+        }
+        case QueryType::Find:
+        {
+            uint8_t exact;
+            int32_t minimumLength;
+            string fragment;
+            if (!in.read(exact) || !in.read(minimumLength) || !in.readString(fragment) || !in.atEnd())
+                return false;
+            vector<DNAMatchId> matches;
+            bool found=m_library.findGenomesWithThisDNA(fragment, minimumLength, exact!=0, matches);
+            out.write(static_cast<uint8_t>(found));
+            out.write(static_cast<uint32_t>(matches.size()));
+            for (size_t k=0;k<matches.size();k++)
+            {
+                out.write(static_cast<int32_t>(matches[k].genomeId));
+                out.write(static_cast<int32_t>(matches[k].length));
+                out.write(static_cast<int32_t>(matches[k].position));
+            }
+            return true;
+        }
+        case QueryType::Related:
+        {
+            uint8_t exact;
+            int32_t fragmentMatchLength, topK;
+            double threshold;
+            string sequence;
+            if (!in.read(exact) || !in.read(fragmentMatchLength) || !in.read(threshold) || !in.read(topK)
+                || !in.readString(sequence) || !in.atEnd() || fragmentMatchLength<1 || !isBases(sequence))
+                return false;
+            RelatedGenomesOptions options;
+            options.topK=max(0, static_cast<int>(topK));
+            vector<GenomeMatchId> results;
+            bool found=m_library.findRelatedGenomes(Genome("query", sequence), fragmentMatchLength, exact!=0, threshold, results, options);
+            out.write(static_cast<uint8_t>(found));
+            out.write(static_cast<uint32_t>(results.size()));
+            for (size_t k=0;k<results.size();k++)
+            {
+                out.write(static_cast<int32_t>(results[k].genomeId));
+                out.write(results[k].percentMatch);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+//******************** QueryServer functions ********************************
+
+// These functions simply delegate to QueryServerImpl's functions.
+
+QueryServer::QueryServer(const GenomeMatcher& library, int threads)
+{
+    m_impl = new QueryServerImpl(library, threads);
+}
+
+QueryServer::~QueryServer()
+{
+    delete m_impl;
+}
+
+bool QueryServer::listen(const string& address, string& error)
+{
+    return m_impl->listen(address, error);
+}
+
+void QueryServer::run()
+{
+    m_impl->run();
+}
+
+void QueryServer::stop()
+{
+    m_impl->stop();
+}
@@ -0,0 +1,35 @@
+#ifndef QUERYSERVER_INCLUDED
+#define QUERYSERVER_INCLUDED
+
+#include <string>
+
+class GenomeMatcher;
+class QueryServerImpl;
+
+//Answers findGenomesWithThisDNA and findRelatedGenomes for clients on a socket, using the protocol in
+//QueryProtocol.h, so any number of processes can share one library that is loaded (or mapped) once.
+//Each connection has a thread reading its requests and one writing the responses; the requests themselves
+//run on a pool of worker threads, several of one connection's at a time, and every response is queued
+//for the writer as soon as it is ready, so a client that doesn't read its answers holds up no worker.
+class QueryServer
+{
+public:
+    //serve library, which must outlast the server, on threads worker threads (0 for every hardware thread)
+    QueryServer(const GenomeMatcher& library, int threads);
+    ~QueryServer();
+    //start listening on address ("unix:PATH", "HOST:PORT" or "PORT"), false with the reason in error if it can't
+    bool listen(const std::string& address, std::string& error);
+    //accept and answer connections until stop(), then close them all and return once the requests
+    //already read have been answered
+    void run();
+    //make run() return; safe to call from another thread or a signal handler
+    void stop();
+    // C++11 syntax for preventing copying and assignment
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+
+private:
+    QueryServerImpl* m_impl;
+};
+
+#endif // QUERYSERVER_INCLUDED
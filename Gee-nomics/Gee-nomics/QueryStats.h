@@ -0,0 +1,135 @@
+#ifndef QUERYSTATS_INCLUDED
+#define QUERYSTATS_INCLUDED
+
+//Hooks for the counters and timers behind GenomeMatcher::statistics(). They only do anything in a build
+//with GEENOMICS_STATS defined (-DGEENOMICS_STATS); otherwise every hook below expands to nothing, or to a
+//cast of a plain local to void, so the hot paths compile exactly as they would without them.
+//
+//    GEENOMICS_COUNT(counter, n)        add n to one of the QueryStats counters
+//    GEENOMICS_RECORD(histogram, value) add a sample to one of its histograms
+//    GEENOMICS_TIME(histogram)          time the rest of the enclosing block into a histogram, in ns
+//
+//A QueryCount is a local to count into before a GEENOMICS_COUNT: a long long in a statistics build, and an
+//empty type that ignores += otherwise, so passing one down (as to Trie::forEach) costs nothing.
+
+#ifdef GEENOMICS_STATS
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//a log2 histogram: bucket 0 counts zeros, bucket b the values from 2^(b-1) to 2^b-1
+struct QueryHistogram
+{
+    static const int BUCKETS=48;
+    std::atomic<long long> buckets[BUCKETS];
+    std::atomic<long long> samples;
+    std::atomic<long long> total;
+
+    QueryHistogram()
+    {
+        reset();
+    }
+    void reset()
+    {
+        for (int b=0;b<BUCKETS;b++)
+            buckets[b]=0;
+        samples=0;
+        total=0;
+    }
+    void add(uint64_t value)
+    {
+        int b=0;
+        for (uint64_t v=value;v!=0 && b<BUCKETS-1;v>>=1)
+            b++;
+        buckets[b].fetch_add(1, std::memory_order_relaxed);
+        samples.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(static_cast<long long>(value), std::memory_order_relaxed);
+    }
+};
+
+//Everything counted since the last reset, for every GenomeMatcher in the process. The counters are relaxed
+//atomics, and the hot loops count into locals and add them here once per call.
+struct QueryStats
+{
+    std::atomic<long long> fragments;
+    std::atomic<long long> seedLookups;
+    std::atomic<long long> trieNodesVisited;
+    std::atomic<long long> candidates;
+    std::atomic<long long> candidatesRejected;
+    std::atomic<long long> bufferBytes;
+    QueryHistogram candidatesPerSeed;
+    QueryHistogram extensionLength;
+    QueryHistogram lookupNanos;
+    QueryHistogram extensionNanos;
+    QueryHistogram aggregationNanos;
+
+    QueryStats()
+    {
+        reset();
+    }
+    void reset()
+    {
+        fragments=0;
+        seedLookups=0;
+        trieNodesVisited=0;
+        candidates=0;
+        candidatesRejected=0;
+        bufferBytes=0;
+        candidatesPerSeed.reset();
+        extensionLength.reset();
+        lookupNanos.reset();
+        extensionNanos.reset();
+        aggregationNanos.reset();
+    }
+};
+
+inline QueryStats& queryStats()
+{
+    static QueryStats stats;
+    return stats;
+}
+
+//adds the time from its construction to its destruction to a histogram
+class QueryTimer
+{
+public:
+    explicit QueryTimer(QueryHistogram& histogram)
+    : m_histogram(histogram), m_start(std::chrono::steady_clock::now())
+    {
+    }
+    ~QueryTimer()
+    {
+        m_histogram.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-m_start).count());
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    QueryTimer(const QueryTimer&) = delete;
+    QueryTimer& operator=(const QueryTimer&) = delete;
+private:
+    QueryHistogram& m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+typedef long long QueryCount;
+
+#define GEENOMICS_COUNT(counter, n) (queryStats().counter.fetch_add(static_cast<long long>(n), std::memory_order_relaxed))
+#define GEENOMICS_RECORD(histogram, value) (queryStats().histogram.add(static_cast<uint64_t>(value)))
+#define GEENOMICS_TIMER_NAME(line) geenomicsTimer##line
+#define GEENOMICS_TIMER(histogram, line) QueryTimer GEENOMICS_TIMER_NAME(line)(queryStats().histogram)
+#define GEENOMICS_TIME(histogram) GEENOMICS_TIMER(histogram, __LINE__)
+
+#else
+
+struct QueryCount
+{
+    void operator+=(long long) {}
+};
+
+#define GEENOMICS_COUNT(counter, n) ((void)(n))
+#define GEENOMICS_RECORD(histogram, value) ((void)(value))
+#define GEENOMICS_TIME(histogram) ((void)0)
+
+#endif // GEENOMICS_STATS
+
+#endif // QUERYSTATS_INCLUDED
@@ -0,0 +1,208 @@
+#ifndef SEQUENCEREADER_INCLUDED
+#define SEQUENCEREADER_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <istream>
+#include <cstring>
+#include "provided.h"
+#include "PackedSequence.h"
+
+//Reads FASTA or FASTQ records one at a time, so a file of any size can be gone through in constant memory
+//(beyond the longest record). The format is told by the first character: '>' for FASTA, '@' for FASTQ.
+//FASTA records are a ">name" line and any number of sequence lines; FASTQ records are an "@name" line,
+//sequence lines, a "+" line and quality lines as long as the sequence (which are skipped). Bases are
+//A, C, G, T or N in either case; a carriage return right before a line end is ignored. No line may be
+//empty, and only the first record must have a name (Genome::load has always taken an empty one later).
+//These are the rules for every sequence file, the library's (Genome::load reads it with one of these) as
+//well as the queries'.
+class SequenceReader
+{
+public:
+    //format is '>' or '@' to take only FASTA or only FASTQ, 0 for whichever the first record is
+    explicit SequenceReader(std::istream& source, char format=0)
+    : m_source(source.rdbuf()), m_block(BLOCK_SIZE), m_next(nullptr), m_end(nullptr), m_line(0), m_format(format), m_records(0), m_havePending(false)
+    {
+    }
+    //append the next record to records, false at the end of the input or at an error (see error())
+    bool next(std::vector<Genome>& records);
+    //empty unless next() stopped at something that isn't valid FASTA or FASTQ
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+    // C++11 syntax for preventing copying and assignment
+    SequenceReader(const SequenceReader&) = delete;
+    SequenceReader& operator=(const SequenceReader&) = delete;
+private:
+    static const int BLOCK_SIZE=1<<20;
+    std::streambuf* m_source;
+    std::vector<char> m_block;
+    const char* m_next;      //the unread part of the block
+    const char* m_end;
+    std::string m_carry;     //a line that runs over the end of a block
+    long long m_line;        //lines read so far, for error messages
+    char m_format;           //'>' or '@' once the first record has been seen
+    long long m_records;     //records read so far
+    std::string m_pending;   //a FASTA name line read ahead while looking for the end of the record before it
+    bool m_havePending;
+    std::string m_error;
+
+    //the next line without its line end, a view that lasts until the next call; false at the end of the input
+    bool nextLine(std::string_view& line);
+    //what each byte is as a base: its 2-bit code, PackedSequence::N_CODE, or NOT_A_BASE
+    static const int NOT_A_BASE=-1;
+    struct BaseCodes
+    {
+        int code[256];
+        BaseCodes()
+        {
+            for (int c=0;c<256;c++)
+                code[c]=NOT_A_BASE;
+            const char bases[]="ACGT";
+            for (int k=0;k<4;k++)
+            {
+                code[static_cast<unsigned char>(bases[k])]=k;
+                code[bases[k]-'A'+'a']=k;
+            }
+            code['N']=code['n']=PackedSequence::N_CODE;
+        }
+    };
+    //append a line of bases to sequence, false if it holds anything else
+    bool appendBases(std::string_view line, PackedSequence& sequence)
+    {
+        static const BaseCodes bases;
+        for (size_t i=0;i<line.size();i++)
+        {
+            int code=bases.code[static_cast<unsigned char>(line[i])];
+            if (code==NOT_A_BASE)
+                return fail("not a base");
+            sequence.appendCode(code);
+        }
+        return true;
+    }
+    bool fail(const char* reason)
+    {
+        m_error="line "+std::to_string(m_line)+": "+reason;
+        return false;
+    }
+};
+
+inline bool SequenceReader::nextLine(std::string_view& line)
+{
+    m_carry.clear();
+    for (;;)
+    {
+        if (m_next==m_end)
+        {
+            std::streamsize got=m_source->sgetn(m_block.data(), BLOCK_SIZE);
+            if (got<=0)
+            {
+                //a last line without a line end
+                if (m_carry.empty())
+                    return false;
+                break;
+            }
+            m_next=m_block.data();
+            m_end=m_next+got;
+        }
+        const char* eol=static_cast<const char*>(std::memchr(m_next, '\n', m_end-m_next));
+        if (eol==nullptr)
+        {
+            m_carry.append(m_next, m_end);
+            m_next=m_end;
+            continue;
+        }
+        if (m_carry.empty())
+            line=std::string_view(m_next, eol-m_next);
+        else
+        {
+            m_carry.append(m_next, eol);
+            line=m_carry;
+        }
+        m_next=eol+1;
+        m_line++;
+        if (!line.empty() && line.back()=='\r')
+            line.remove_suffix(1);
+        return true;
+    }
+    m_line++;
+    line=m_carry;
+    if (!line.empty() && line.back()=='\r')
+        line.remove_suffix(1);
+    return true;
+}
+
+inline bool SequenceReader::next(std::vector<Genome>& records)
+{
+    if (!m_error.empty())
+        return false;
+    std::string_view line;
+    std::string name;
+    if (m_havePending)
+    {
+        name=m_pending;
+        m_havePending=false;
+    }
+    else
+    {
+        if (!nextLine(line))
+            return false;
+        if (m_format==0 && !line.empty() && (line[0]=='>' || line[0]=='@'))
+            m_format=line[0];
+        if (m_format==0 || line.empty() || line[0]!=m_format)
+            return fail(m_format=='@' ? "expected an @name line" : "expected a >name line");
+        name.assign(line.substr(1));
+    }
+    if (name.empty() && m_records==0)
+        return fail("empty name");
+    PackedSequence sequence;
+    if (m_format=='>')
+    {
+        //the record runs until the next name line or the end of the input
+        while (nextLine(line))
+        {
+            if (!line.empty() && line[0]=='>')
+            {
+                m_pending.assign(line.substr(1));
+                m_havePending=true;
+                break;
+            }
+            if (line.empty())
+                return fail("empty line");
+            if (!appendBases(line, sequence))
+                return false;
+        }
+    }
+    else
+    {
+        //the sequence runs until the '+' line, then the same number of quality characters follow
+        for (;;)
+        {
+            if (!nextLine(line))
+                return fail("record ends before its + line");
+            if (!line.empty() && line[0]=='+')
+                break;
+            if (!appendBases(line, sequence))
+                return false;
+        }
+        int quality=0;
+        while (quality<sequence.length())
+        {
+            if (!nextLine(line) || line.empty())
+                return fail("quality shorter than the sequence");
+            quality+=static_cast<int>(line.size());
+        }
+        if (quality!=sequence.length())
+            return fail("quality longer than the sequence");
+    }
+    if (sequence.length()==0)
+        return fail("record has no bases");
+    records.push_back(Genome(name, sequence));
+    m_records++;
+    return true;
+}
+
+#endif // SEQUENCEREADER_INCLUDED
@@ -0,0 +1,280 @@
+#ifndef SUFFIXARRAY_INCLUDED
+#define SUFFIXARRAY_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include "MappedStorage.h"
+
+//The sorted suffixes of a text of small symbols.
+//Symbol 0 is a separator: it sorts before everything and never appears in a searched fragment, so a
+//match can't run across it. The text must end with one.
+class SuffixArray
+{
+public:
+    static const uint8_t SEPARATOR=0;
+
+    SuffixArray();
+    void reset();
+    //appending invalidates the order until the next build()
+    void append(uint8_t symbol);
+    bool built() const;
+    //SA-IS, linear time
+    void build();
+    int size() const;
+    uint8_t symbol(int position) const;
+    //the text position of the suffix with this rank
+    int suffix(int rank) const;
+    //[lo,hi) is a range of ranks whose suffixes share their first depth symbols;
+    //shrink it to the ones whose next symbol is s
+    void narrow(int& lo, int& hi, int depth, uint8_t s) const;
+    //the text and the sorted suffixes, for the memory accounting
+    void countBytes(ByteCount& count) const;
+    //builds first if needed; a loaded array is a view into the reader's file
+    void save(IndexWriter& writer);
+    bool load(IndexReader& reader);
+
+    // C++11 syntax for preventing copying and assignment
+    SuffixArray(const SuffixArray&) = delete;
+    SuffixArray& operator=(const SuffixArray&) = delete;
+private:
+    Storage<uint8_t> m_text;
+    Storage<int> m_suffixes;
+    bool m_built;
+
+    template<typename Symbols>
+    static std::vector<int> induceSort(const Symbols& s, int upper);
+    //whether a loaded array holds together: a text ending in a separator, and suffixes that are every
+    //position of it once, in order of their first symbols
+    bool valid() const;
+};
+
+inline SuffixArray::SuffixArray()
+: m_built(true)
+{
+}
+
+inline void SuffixArray::reset()
+{
+    m_text.clear();
+    m_suffixes.clear();
+    m_built=true;
+}
+
+inline void SuffixArray::append(uint8_t symbol)
+{
+    m_text.push_back(symbol);
+    m_built=false;
+}
+
+inline bool SuffixArray::built() const
+{
+    return m_built;
+}
+
+inline void SuffixArray::build()
+{
+    m_suffixes=induceSort(m_text, 255);
+    m_built=true;
+}
+
+//SA-IS (Nong, Zhang and Chan): sort the LMS suffixes, induce the rest from them, and recurse on the
+//reduced string of LMS substring names when two of them tie. s holds symbols in [0,upper].
+template<typename Symbols>
+std::vector<int> SuffixArray::induceSort(const Symbols& s, int upper)
+{
+    int n=static_cast<int>(s.size());
+    if (n==0)
+        return std::vector<int>();
+    if (n==1)
+        return std::vector<int>(1, 0);
+    std::vector<int> sa(n);
+    //isS[i] is true for an S-type suffix (smaller than the one after it), the last one is L-type
+    std::vector<bool> isS(n);
+    for (int i=n-2;i>=0;i--)
+        isS[i]=(s[i]==s[i+1]) ? isS[i+1] : (s[i]<s[i+1]);
+    //bucket starts: L-type suffixes start a bucket, S-type ones follow them
+    std::vector<int> startL(upper+1), startS(upper+1);
+    for (int i=0;i<n;i++)
+    {
+        if (!isS[i])
+            startS[s[i]]++;
+        else if (s[i]<upper)
+            startL[s[i]+1]++;
+    }
+    for (int c=0;c<=upper;c++)
+    {
+        startS[c]+=startL[c];
+        if (c<upper)
+            startL[c+1]+=startS[c];
+    }
+    auto induce=[&](const std::vector<int>& lms)
+    {
+        std::fill(sa.begin(), sa.end(), -1);
+        std::vector<int> bucket(startS);
+        for (size_t k=0;k<lms.size();k++)
+            sa[bucket[s[lms[k]]]++]=lms[k];
+        //L-type suffixes left to right
+        bucket=startL;
+        sa[bucket[s[n-1]]++]=n-1;
+        for (int r=0;r<n;r++)
+        {
+            int v=sa[r];
+            if (v>=1 && !isS[v-1])
+                sa[bucket[s[v-1]]++]=v-1;
+        }
+        //S-type suffixes right to left, filling each bucket from its end
+        bucket=startL;
+        for (int r=n-1;r>=0;r--)
+        {
+            int v=sa[r];
+            if (v>=1 && isS[v-1])
+                sa[--bucket[s[v-1]+1]]=v-1;
+        }
+    };
+    //the leftmost S-type positions (LMS), in text order
+    std::vector<int> lmsIndex(n, -1);
+    std::vector<int> lms;
+    for (int i=1;i<n;i++)
+    {
+        if (!isS[i-1] && isS[i])
+        {
+            lmsIndex[i]=static_cast<int>(lms.size());
+            lms.push_back(i);
+        }
+    }
+    induce(lms);
+    int m=static_cast<int>(lms.size());
+    if (m==0)
+        return sa;
+    //name the LMS substrings in sorted order, equal substrings share a name
+    std::vector<int> sortedLms;
+    sortedLms.reserve(m);
+    for (int r=0;r<n;r++)
+    {
+        if (lmsIndex[sa[r]]!=-1)
+            sortedLms.push_back(sa[r]);
+    }
+    std::vector<int> reduced(m);
+    int names=0;
+    reduced[lmsIndex[sortedLms[0]]]=0;
+    for (int k=1;k<m;k++)
+    {
+        int l=sortedLms[k-1], r=sortedLms[k];
+        int endL=(lmsIndex[l]+1<m) ? lms[lmsIndex[l]+1] : n;
+        int endR=(lmsIndex[r]+1<m) ? lms[lmsIndex[r]+1] : n;
+        bool same=(endL-l==endR-r);
+        if (same)
+        {
+            for (;l<endL && s[l]==s[r];l++,r++)
+                ;
+            if (l==n || s[l]!=s[r])
+                same=false;
+        }
+        if (!same)
+            names++;
+        reduced[lmsIndex[sortedLms[k]]]=names;
+    }
+    //sort the LMS suffixes for real, then induce again from the right order
+    std::vector<int> reducedSa=induceSort(reduced, names);
+    for (int k=0;k<m;k++)
+        sortedLms[k]=lms[reducedSa[k]];
+    induce(sortedLms);
+    return sa;
+}
+
+inline int SuffixArray::size() const
+{
+    return static_cast<int>(m_text.size());
+}
+
+inline uint8_t SuffixArray::symbol(int position) const
+{
+    return m_text[position];
+}
+
+inline int SuffixArray::suffix(int rank) const
+{
+    return m_suffixes[rank];
+}
+
+inline void SuffixArray::narrow(int& lo, int& hi, int depth, uint8_t s) const
+{
+    //the suffixes in the range agree on everything before depth, so they are sorted by the symbol at depth
+    //(none of them can run off the end: they matched depth symbols that weren't separators, and the text ends with one)
+    auto symbolAt=[this, depth](int rank) { return m_text[m_suffixes[rank]+depth]; };
+    int first=lo, last=hi;
+    while (first<last)
+    {
+        int mid=first+(last-first)/2;
+        if (symbolAt(mid)<s)
+            first=mid+1;
+        else
+            last=mid;
+    }
+    int newLo=first;
+    last=hi;
+    while (first<last)
+    {
+        int mid=first+(last-first)/2;
+        if (symbolAt(mid)<=s)
+            first=mid+1;
+        else
+            last=mid;
+    }
+    lo=newLo;
+    hi=first;
+}
+
+inline void SuffixArray::countBytes(ByteCount& count) const
+{
+    count.add(m_text);
+    count.add(m_suffixes);
+}
+
+inline void SuffixArray::save(IndexWriter& writer)
+{
+    if (!m_built)
+        build();
+    writer.writeArray(m_text);
+    writer.writeArray(m_suffixes);
+}
+
+inline bool SuffixArray::load(IndexReader& reader)
+{
+    if (!reader.readArray(m_text) || !reader.readArray(m_suffixes) || !valid())
+    {
+        reset();
+        return false;
+    }
+    m_built=true;
+    return true;
+}
+
+inline bool SuffixArray::valid() const
+{
+    //read through the const accessors, so a view stays a view
+    const Storage<uint8_t>& text=m_text;
+    const Storage<int>& suffixes=m_suffixes;
+    if (text.size()!=suffixes.size() || text.size()>static_cast<size_t>(INT_MAX))
+        return false;
+    if (text.empty())
+        return true;
+    if (text.back()!=SEPARATOR)
+        return false;
+    int n=static_cast<int>(text.size());
+    std::vector<char> seen(n, 0);
+    for (int rank=0;rank<n;rank++)
+    {
+        int position=suffixes[rank];
+        if (position<0 || position>=n || seen[position])
+            return false;
+        seen[position]=1;
+        if (rank>0 && text[suffixes[rank-1]]>text[position])
+            return false;
+    }
+    return true;
+}
+
+#endif // SUFFIXARRAY_INCLUDED
@@ -0,0 +1,138 @@
+#ifndef THREADPOOL_INCLUDED
+#define THREADPOOL_INCLUDED
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+//A fixed set of worker threads that run queued tasks in order.
+class ThreadPool
+{
+public:
+    //with no threads parallelFor runs everything on the calling thread
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+    int size() const;
+    static int hardwareThreads()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    void submit(std::function<void()> task);
+    //Call body(index, slot) for every index in [0,count). The calling thread works through the
+    //indices too, alongside up to maxHelpers pool threads (-1 for all of them), and this returns once
+    //every index is done. slot is in [0, helpers+1) and no two threads share one at the same time,
+    //so it can pick per-thread scratch space. Not to be called from inside a pool task.
+    template<typename Body>
+    void parallelFor(int count, Body body, int maxHelpers=-1);
+
+    // C++11 syntax for preventing copying and assignment
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+private:
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    bool m_stopping;
+
+    void work();
+};
+
+inline ThreadPool::ThreadPool(int threads)
+: m_stopping(false)
+{
+    for (int k=0;k<threads;k++)
+        m_workers.push_back(std::thread(&ThreadPool::work, this));
+}
+
+//finish what is queued, then join
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping=true;
+    }
+    m_ready.notify_all();
+    for (size_t k=0;k<m_workers.size();k++)
+        m_workers[k].join();
+}
+
+inline int ThreadPool::size() const
+{
+    return static_cast<int>(m_workers.size());
+}
+
+inline void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push(std::move(task));
+    }
+    m_ready.notify_one();
+}
+
+inline void ThreadPool::work()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+            task=std::move(m_tasks.front());
+            m_tasks.pop();
+        }
+        task();
+    }
+}
+
+template<typename Body>
+void ThreadPool::parallelFor(int count, Body body, int maxHelpers)
+{
+    if (count<=0)
+        return;
+    int helpers=(maxHelpers<0) ? size() : std::min(maxHelpers, size());
+    helpers=std::min(helpers, count-1);
+    //shared with the helpers, which may only get to run after every index is taken;
+    //they touch body only while they still hold an index
+    struct State
+    {
+        std::atomic<int> next{0};
+        std::atomic<int> slots{0};
+        int done=0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state=std::make_shared<State>();
+    auto run=[state, count, &body]()
+    {
+        int slot=state->slots++;
+        int completed=0;
+        for (int i=state->next++;i<count;i=state->next++)
+        {
+            body(i, slot);
+            completed++;
+        }
+        if (completed==0)
+            return;
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done+=completed;
+        if (state->done==count)
+            state->finished.notify_all();
+    };
+    for (int k=0;k<helpers;k++)
+        submit(run);
+    run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state, count] { return state->done==count; });
+}
+
+#endif // THREADPOOL_INCLUDED
@@ -2,8 +2,63 @@
 #define TRIE_INCLUDED
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <climits>
+#include <type_traits>
+#include "MappedStorage.h"
 
+//the letters a trie branches on: A, C, G, T, N (either case) map to 0-4, anything else to -1 and can't be stored
+struct DnaAlphabet
+{
+    static const int SIZE=5;
+    static int index(char c)
+    {
+        switch (c)
+        {
+            case 'A': case 'a': return 0;
+            case 'C': case 'c': return 1;
+            case 'G': case 'g': return 2;
+            case 'T': case 't': return 3;
+            case 'N': case 'n': return 4;
+            default: return -1;
+        }
+    }
+};
+
+//A loaded trie's value chains are sound if every slot's next comes after it (as appending makes them), so
+//following one can only run forward and off the end, and each chain's head and tail are both NONE or in
+//the pool with the tail no earlier than the head.
+template<typename ValueSlot>
+bool validValueChains(const Storage<ValueSlot>& values)
+{
+    if (values.size()>static_cast<size_t>(INT_MAX))
+        return false;
+    for (size_t v=0;v<values.size();v++)
+    {
+        int next=values[v].m_next;
+        if (next!=-1 && (next<=static_cast<int>(v) || next>=static_cast<int>(values.size())))
+            return false;
+    }
+    return true;
+}
+
+inline bool validValueChain(int first, int last, size_t values)
+{
+    if (first==-1 || last==-1)
+        return first==last;
+    return first>=0 && first<=last && last<static_cast<int>(values);
+}
+
+//What forEach() counts the nodes it steps through into when the caller doesn't want them: nothing, so the
+//counting compiles away. A caller that does passes a long long.
+struct NoNodeCount
+{
+    void operator+=(long long) {}
+};
+
+//A multimap from DNA keys (A, C, G, T, N) to values.
+//Keys with any other character are ignored by insert() and never found.
 template<typename ValueType>
 class Trie
 {
@@ -11,100 +66,112 @@ public:
     Trie();
     ~Trie();
     void reset();
-    void insert(const std::string& key, const ValueType& value);
-    std::vector<ValueType> find(const std::string& key, bool exactMatchOnly) const;
+    void insert(std::string_view key, const ValueType& value);
+    //the first value stored under key, inserting value first if key has none (nullptr for a bad key);
+    //good until the trie is next changed
+    const ValueType* findOrInsert(std::string_view key, const ValueType& value);
+    std::vector<ValueType> find(std::string_view key, bool exactMatchOnly) const;
+    //appends the values to result instead of returning a new vector, so callers can reuse one buffer
+    void find(std::string_view key, bool exactMatchOnly, std::vector<ValueType>& result) const;
+    //calls visit(value) for every value find() would return, without collecting them
+    template<typename Visitor>
+    void forEach(std::string_view key, bool exactMatchOnly, Visitor visit) const
+    {
+        NoNodeCount none;
+        forEach(key, exactMatchOnly, visit, none);
+    }
+    //the same, adding the number of nodes stepped through to visited
+    template<typename Visitor, typename NodeCount>
+    void forEach(std::string_view key, bool exactMatchOnly, Visitor visit, NodeCount& visited) const;
+    //the nodes and values, for the memory accounting
+    void countBytes(ByteCount& count) const;
+    //ValueType must be plain data; a loaded trie is a view into the reader's file until it is next changed
+    void save(IndexWriter& writer) const;
+    bool load(IndexReader& reader);
     
     // C++11 syntax for preventing copying and assignment
     Trie(const Trie&) = delete;
     Trie& operator=(const Trie&) = delete;
 private:
+    //one slot per base, indexed by childIndex()
+    static const int NUM_CHILDREN=DnaAlphabet::SIZE;
+    static const int NONE=-1;
+    //nodes live in one contiguous arena and refer to each other by index, m_nodes[0] is the root
     struct TreeNode
     {
-        std::vector <TreeNode*> m_childrenPtr;
-        std::vector <char> m_childrenLabel;
-        std::vector<ValueType> m_value;
+        int m_children[NUM_CHILDREN];
+        int m_firstValue;   //head of this node's value chain in m_values, NONE if it has no values
+        int m_lastValue;    //tail, so new values keep their insertion order
     };
-    TreeNode* m_root;
-    //this is the helper function of insert
-    TreeNode* insertHelper(std::string key,TreeNode* p)
-    {
-        //reached the end
-        if (key=="")
-            return p;
-        //for all child pointers and the corresponding labels
-        for (size_t k=0;k<p->m_childrenPtr.size();k++)
-        {
-            if (p->m_childrenLabel[k]==key[0])
-                //move on to the next char in key with this childrenPtr
-                return insertHelper(key.substr(1),p->m_childrenPtr[k]);
-        }
-        //no such label exists, create new one
-        TreeNode* thisChildren=new TreeNode;
-        p->m_childrenPtr.push_back(thisChildren);
-        p->m_childrenLabel.push_back(key[0]);
-        //move on to the next char in key with this childrenPtr
-        return insertHelper(key.substr(1),p->m_childrenPtr.back());
+    //all values share one pool, each node's values are chained through m_next
+    struct ValueSlot
+    {
+        ValueType m_value;
+        int m_next;
+    };
+    Storage<TreeNode> m_nodes;
+    Storage<ValueSlot> m_values;
+    
+    static int childIndex(char c)
+    {
+        return DnaAlphabet::index(c);
     }
-    /*
-    std::vector<ValueType> findHelper(std::string key, bool canBeWrong, TreeNode* p) const
+    int newNode()
     {
-        if (p==nullptr)
-        {
-            std::vector<ValueType> empty;
-            return empty;
-        }
-        if (key=="")
-            return p->m_value;
-        std::vector<ValueType> totalValue;
-        for (size_t k=0;k<p->m_childrenPtr.size();k++)
-        {
-            std::vector<ValueType> thisValue;
-            if (p->m_childrenLabel[k]==key[0])
-                thisValue=findHelper(key.substr(1), canBeWrong, p->m_childrenPtr[k]);
-            else if (canBeWrong && p!=m_root)
-                thisValue=findHelper(key.substr(1), false, p->m_childrenPtr[k]);
-            for (size_t k=0;k<thisValue.size();k++)
-                totalValue.push_back(thisValue[k]);
-            
-        }
-        return totalValue;
+        TreeNode node;
+        for (int k=0;k<NUM_CHILDREN;k++)
+            node.m_children[k]=NONE;
+        node.m_firstValue=NONE;
+        node.m_lastValue=NONE;
+        m_nodes.push_back(node);
+        return static_cast<int>(m_nodes.size()-1);
     }
-    */
-    void findHelper(std::string key, bool canBeWrong, TreeNode* p,std::vector<ValueType>& result) const
+    //this is the helper function of insert, it returns the index of the node for key (NONE for a bad key)
+    int insertHelper(std::string_view key)
     {
-        //reaches the end of the tree
-        if (p==nullptr)
-            return;
-        //reaches the end of the key, therefore we can put in the values at the current position to the result
-        if (key.empty())
+        int p=0;
+        for (size_t d=0;d<key.size();d++)
         {
-            for (size_t k=0;k<p->m_value.size();k++)
-                result.push_back(p->m_value[k]);
-            return;
+            int k=childIndex(key[d]);
+            if (k==NONE)
+                return NONE;
+            //no such label exists, create new one
+            //(newNode() may move the arena, so don't hold on to a reference across it)
+            if (m_nodes[p].m_children[k]==NONE)
+            {
+                int child=newNode();
+                m_nodes[p].m_children[k]=child;
+            }
+            //move on to the next char in key with this child
+            p=m_nodes[p].m_children[k];
         }
-        //for all child pointers and the correpsonding labels
-        for (size_t k=0;k<p->m_childrenPtr.size();k++)
+        return p;
+    }
+    //follow key[from..] exactly, starting at node p, and return where it ends (NONE if it falls off the tree)
+    //(visited counts the nodes stepped through, as in forEach())
+    template<typename NodeCount>
+    int walk(int p, std::string_view key, size_t from, NodeCount& visited) const
+    {
+        for (size_t d=from;d<key.size() && p!=NONE;d++)
         {
-            //if matches
-            if (p->m_childrenLabel[k]==key[0])
-                //move on to the next
-                findHelper(key.substr(1), canBeWrong, p->m_childrenPtr[k],result);
-            //if not matches and can be wrong and is not at the beginning
-            else if (canBeWrong && p!=m_root)
-                //move on to the next with can't be wrong
-                findHelper(key.substr(1), false, p->m_childrenPtr[k],result);
-            
+            int k=childIndex(key[d]);
+            if (k==NONE)
+                return NONE;
+            p=m_nodes[p].m_children[k];
+            visited+=1;
         }
+        return p;
     }
-    
-    //recursivly free all dynamically allocated pointers in the trie
-    void cleaner(TreeNode* p)
+    //append value to the end of node p's chain
+    void addValue(int p, const ValueType& value);
+    //whether loaded arrays hold together: every index in range, and every child after its parent (as
+    //insert() makes them), so no walk can leave the arrays or go round in a loop
+    bool valid() const;
+    template<typename Visitor>
+    void visitValues(int p, Visitor& visit) const
     {
-        if (p==nullptr)
-            return;
-        for (size_t k=0;k<p->m_childrenPtr.size();k++)
-            cleaner( p->m_childrenPtr[k]);
-        delete p;
+        for (int v=m_nodes[p].m_firstValue;v!=NONE;v=m_values[v].m_next)
+            visit(m_values[v].m_value);
     }
 };
 
@@ -112,44 +179,461 @@ private:
 template<typename ValueType>
 Trie<ValueType>::Trie()
 {
-    m_root=new TreeNode;
+    newNode();
 }
 
-//destruct by calling the cleaner
+//the arena frees itself
 template<typename ValueType>
 Trie<ValueType>::~Trie()
 {
-    cleaner(m_root);
 }
 
-//first clean and then allocate a new root
+//drop every node and value and start again from a fresh root
 template<typename ValueType>
 void Trie<ValueType>::reset()
 {
-    cleaner(m_root);
-    m_root=new TreeNode;
+    m_nodes.clear();
+    m_values.clear();
+    newNode();
+}
+
+//call the insert helper function and the returned node is where the value should store
+template<typename ValueType>
+void Trie<ValueType>::insert(std::string_view key, const ValueType& value)
+{
+    int storeValueHere=insertHelper(key);
+    if (storeValueHere!=NONE)
+        addValue(storeValueHere, value);
+}
+
+template<typename ValueType>
+void Trie<ValueType>::addValue(int storeValueHere, const ValueType& value)
+{
+    ValueSlot slot;
+    slot.m_value=value;
+    slot.m_next=NONE;
+    m_values.push_back(slot);
+    int v=static_cast<int>(m_values.size()-1);
+    TreeNode& node=m_nodes[storeValueHere];
+    if (node.m_lastValue==NONE)
+        node.m_firstValue=v;
+    else
+        m_values[node.m_lastValue].m_next=v;
+    node.m_lastValue=v;
 }
 
-//call the insert helper function and the returned pointer is where the value should store
 template<typename ValueType>
-void Trie<ValueType>::insert(const std::string& key, const ValueType& value)
+const ValueType* Trie<ValueType>::findOrInsert(std::string_view key, const ValueType& value)
 {
-    TreeNode* StoreValueHere;
-    StoreValueHere=insertHelper(key, m_root);
-    StoreValueHere->m_value.push_back(value);
+    int p=insertHelper(key);
+    if (p==NONE)
+        return nullptr;
+    if (m_nodes[p].m_firstValue==NONE)
+        addValue(p, value);
+    return &m_values[m_nodes[p].m_firstValue].m_value;
 }
 
-//call the find helper function
+//collect everything forEach() visits
 template<typename ValueType>
-std::vector<ValueType> Trie<ValueType>::find(const std::string& key, bool exactMatchOnly) const
+std::vector<ValueType> Trie<ValueType>::find(std::string_view key, bool exactMatchOnly) const
 {
     std::vector<ValueType> result;
-    findHelper(key,!exactMatchOnly,m_root,result);
+    find(key,exactMatchOnly,result);
     return result;
-    //return findHelper(key,!exactMatchOnly,m_root);
 }
 
+template<typename ValueType>
+void Trie<ValueType>::find(std::string_view key, bool exactMatchOnly, std::vector<ValueType>& result) const
+{
+    forEach(key, exactMatchOnly, [&result](const ValueType& value) { result.push_back(value); });
+}
+
+//Walk the exact path for key one level at a time. When one mismatch is allowed, every other child
+//hanging off the path (below the root, the first char must always match) is followed exactly for the
+//rest of the key. No recursion and no copies of the key, so nothing is allocated.
+template<typename ValueType>
+template<typename Visitor, typename NodeCount>
+void Trie<ValueType>::forEach(std::string_view key, bool exactMatchOnly, Visitor visit, NodeCount& visited) const
+{
+    int p=0;
+    for (size_t d=0;p!=NONE;d++)
+    {
+        visited+=1;
+        //reaches the end of the key, therefore the values at the current node belong to the result
+        if (d==key.size())
+        {
+            visitValues(p, visit);
+            break;
+        }
+        int match=childIndex(key[d]);
+        if (!exactMatchOnly && d>0)
+        {
+            for (int k=0;k<NUM_CHILDREN;k++)
+            {
+                int child=m_nodes[p].m_children[k];
+                if (k==match || child==NONE)
+                    continue;
+                //this is the one mismatch, the rest has to be exact
+                int end=walk(child, key, d+1, visited);
+                if (end!=NONE)
+                    visitValues(end, visit);
+            }
+        }
+        p=(match==NONE) ? NONE : m_nodes[p].m_children[match];
+    }
+}
+
+template<typename ValueType>
+void Trie<ValueType>::countBytes(ByteCount& count) const
+{
+    count.add(m_nodes);
+    count.add(m_values);
+}
+
+template<typename ValueType>
+void Trie<ValueType>::save(IndexWriter& writer) const
+{
+    writer.writeArray(m_nodes);
+    writer.writeArray(m_values);
+}
+
+template<typename ValueType>
+bool Trie<ValueType>::load(IndexReader& reader)
+{
+    if (!reader.readArray(m_nodes) || !reader.readArray(m_values) || !valid())
+    {
+        reset();
+        return false;
+    }
+    return true;
+}
+
+template<typename ValueType>
+bool Trie<ValueType>::valid() const
+{
+    //read through the const accessors, so a view stays a view
+    const Storage<TreeNode>& nodes=m_nodes;
+    const Storage<ValueSlot>& values=m_values;
+    if (nodes.empty() || nodes.size()>static_cast<size_t>(INT_MAX) || !validValueChains(values))
+        return false;
+    int count=static_cast<int>(nodes.size());
+    for (int p=0;p<count;p++)
+    {
+        for (int k=0;k<NUM_CHILDREN;k++)
+        {
+            int child=nodes[p].m_children[k];
+            if (child!=NONE && (child<=p || child>=count))
+                return false;
+        }
+        if (!validValueChain(nodes[p].m_firstValue, nodes[p].m_lastValue, values.size()))
+            return false;
+    }
+    return true;
+}
 
+//The same multimap for keys that are all exactly Depth letters of Alphabet, as the seeds of an index are.
+//With the depth known at compile time the walks are loops of a fixed count the compiler can unroll, with
+//no end-of-key test at each level, and only the last level holds values: inner nodes are just their child
+//arrays, and the children of a node at depth Depth-1 are leaves holding the value chains. Keys of any
+//other length, or with a letter outside Alphabet, are ignored by insert() and never found.
+template<typename ValueType, int Depth, typename Alphabet = DnaAlphabet>
+class KmerTrie
+{
+public:
+    static_assert(Depth>=1, "a KmerTrie needs keys of at least one letter");
+    KmerTrie();
+    void reset();
+    void insert(std::string_view key, const ValueType& value);
+    //as in Trie
+    const ValueType* findOrInsert(std::string_view key, const ValueType& value);
+    std::vector<ValueType> find(std::string_view key, bool exactMatchOnly) const;
+    void find(std::string_view key, bool exactMatchOnly, std::vector<ValueType>& result) const;
+    template<typename Visitor>
+    void forEach(std::string_view key, bool exactMatchOnly, Visitor visit) const
+    {
+        NoNodeCount none;
+        forEach(key, exactMatchOnly, visit, none);
+    }
+    template<typename Visitor, typename NodeCount>
+    void forEach(std::string_view key, bool exactMatchOnly, Visitor visit, NodeCount& visited) const;
+    void countBytes(ByteCount& count) const;
+    void save(IndexWriter& writer) const;
+    bool load(IndexReader& reader);
+    
+    // C++11 syntax for preventing copying and assignment
+    KmerTrie(const KmerTrie&) = delete;
+    KmerTrie& operator=(const KmerTrie&) = delete;
+private:
+    static const int NUM_CHILDREN=Alphabet::SIZE;
+    static const int NONE=-1;
+    //m_nodes[0] is the root; a node's children index m_nodes, or m_leaves at the last level
+    struct InnerNode
+    {
+        int m_children[NUM_CHILDREN];
+    };
+    struct Leaf
+    {
+        int m_firstValue;
+        int m_lastValue;
+    };
+    struct ValueSlot
+    {
+        ValueType m_value;
+        int m_next;
+    };
+    Storage<InnerNode> m_nodes;
+    Storage<Leaf> m_leaves;
+    Storage<ValueSlot> m_values;
+    
+    int newNode()
+    {
+        InnerNode node;
+        for (int k=0;k<NUM_CHILDREN;k++)
+            node.m_children[k]=NONE;
+        m_nodes.push_back(node);
+        return static_cast<int>(m_nodes.size()-1);
+    }
+    int newLeaf()
+    {
+        m_leaves.push_back(Leaf{NONE, NONE});
+        return static_cast<int>(m_leaves.size()-1);
+    }
+    //the leaf for key, made along with any nodes on the way (NONE for a bad key)
+    int insertHelper(std::string_view key)
+    {
+        if (key.size()!=Depth)
+            return NONE;
+        int p=0;
+        for (int d=0;d<Depth;d++)
+        {
+            int k=Alphabet::index(key[d]);
+            if (k<0)
+                return NONE;
+            //(newNode() may move the arena, so don't hold on to a reference across it)
+            if (m_nodes[p].m_children[k]==NONE)
+            {
+                int child=(d==Depth-1) ? newLeaf() : newNode();
+                m_nodes[p].m_children[k]=child;
+            }
+            p=m_nodes[p].m_children[k];
+        }
+        return p;
+    }
+    //follow key[from..] exactly from node p (a leaf if from is Depth) and return the leaf it ends at, or NONE
+    template<typename NodeCount>
+    int walk(int p, std::string_view key, int from, NodeCount& visited) const
+    {
+        for (int d=from;d<Depth;d++)
+        {
+            int k=Alphabet::index(key[d]);
+            if (k<0)
+                return NONE;
+            p=m_nodes[p].m_children[k];
+            visited+=1;
+            if (p==NONE)
+                return NONE;
+        }
+        return p;
+    }
+    void addValue(int leaf, const ValueType& value);
+    //as in Trie, with the children at the last level in range of the leaves instead
+    bool valid() const;
+    template<typename Visitor>
+    void visitValues(int leaf, Visitor& visit) const
+    {
+        for (int v=m_leaves[leaf].m_firstValue;v!=NONE;v=m_values[v].m_next)
+            visit(m_values[v].m_value);
+    }
+};
+
+template<typename ValueType, int Depth, typename Alphabet>
+KmerTrie<ValueType, Depth, Alphabet>::KmerTrie()
+{
+    newNode();
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::reset()
+{
+    m_nodes.clear();
+    m_leaves.clear();
+    m_values.clear();
+    newNode();
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::insert(std::string_view key, const ValueType& value)
+{
+    int leaf=insertHelper(key);
+    if (leaf!=NONE)
+        addValue(leaf, value);
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::addValue(int leaf, const ValueType& value)
+{
+    ValueSlot slot;
+    slot.m_value=value;
+    slot.m_next=NONE;
+    m_values.push_back(slot);
+    int v=static_cast<int>(m_values.size()-1);
+    Leaf& chain=m_leaves[leaf];
+    if (chain.m_lastValue==NONE)
+        chain.m_firstValue=v;
+    else
+        m_values[chain.m_lastValue].m_next=v;
+    chain.m_lastValue=v;
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+const ValueType* KmerTrie<ValueType, Depth, Alphabet>::findOrInsert(std::string_view key, const ValueType& value)
+{
+    int leaf=insertHelper(key);
+    if (leaf==NONE)
+        return nullptr;
+    if (m_leaves[leaf].m_firstValue==NONE)
+        addValue(leaf, value);
+    return &m_values[m_leaves[leaf].m_firstValue].m_value;
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+std::vector<ValueType> KmerTrie<ValueType, Depth, Alphabet>::find(std::string_view key, bool exactMatchOnly) const
+{
+    std::vector<ValueType> result;
+    find(key,exactMatchOnly,result);
+    return result;
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::find(std::string_view key, bool exactMatchOnly, std::vector<ValueType>& result) const
+{
+    forEach(key, exactMatchOnly, [&result](const ValueType& value) { result.push_back(value); });
+}
+
+//The walk of Trie::forEach, Depth levels down; whatever it reaches at the bottom is a leaf.
+template<typename ValueType, int Depth, typename Alphabet>
+template<typename Visitor, typename NodeCount>
+void KmerTrie<ValueType, Depth, Alphabet>::forEach(std::string_view key, bool exactMatchOnly, Visitor visit, NodeCount& visited) const
+{
+    if (key.size()!=Depth)
+        return;
+    int p=0;
+    for (int d=0;d<Depth && p!=NONE;d++)
+    {
+        visited+=1;
+        int match=Alphabet::index(key[d]);
+        const int* children=m_nodes[p].m_children;
+        if (!exactMatchOnly && d>0)
+        {
+            for (int k=0;k<NUM_CHILDREN;k++)
+            {
+                if (k==match || children[k]==NONE)
+                    continue;
+                //this is the one mismatch, the rest has to be exact
+                int leaf=walk(children[k], key, d+1, visited);
+                if (leaf!=NONE)
+                    visitValues(leaf, visit);
+            }
+        }
+        p=(match<0) ? NONE : children[match];
+    }
+    if (p!=NONE)
+        visitValues(p, visit);
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::countBytes(ByteCount& count) const
+{
+    count.add(m_nodes);
+    count.add(m_leaves);
+    count.add(m_values);
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+void KmerTrie<ValueType, Depth, Alphabet>::save(IndexWriter& writer) const
+{
+    writer.writeArray(m_nodes);
+    writer.writeArray(m_leaves);
+    writer.writeArray(m_values);
+}
+
+template<typename ValueType, int Depth, typename Alphabet>
+bool KmerTrie<ValueType, Depth, Alphabet>::load(IndexReader& reader)
+{
+    if (!reader.readArray(m_nodes) || !reader.readArray(m_leaves) || !reader.readArray(m_values) || !valid())
+    {
+        reset();
+        return false;
+    }
+    return true;
+}
+
+//A node's level comes from its parent, which is always checked first, so the last level is known when
+//its children are.
+template<typename ValueType, int Depth, typename Alphabet>
+bool KmerTrie<ValueType, Depth, Alphabet>::valid() const
+{
+    //read through the const accessors, so a view stays a view
+    const Storage<InnerNode>& nodes=m_nodes;
+    const Storage<Leaf>& leaves=m_leaves;
+    const Storage<ValueSlot>& values=m_values;
+    if (nodes.empty() || nodes.size()>static_cast<size_t>(INT_MAX) || leaves.size()>static_cast<size_t>(INT_MAX)
+        || !validValueChains(values))
+        return false;
+    int count=static_cast<int>(nodes.size());
+    //-1 for a node no parent has claimed yet
+    std::vector<int> level(count, -1);
+    level[0]=0;
+    for (int p=0;p<count;p++)
+    {
+        if (level[p]<0)
+            return false;
+        bool last=(level[p]==Depth-1);
+        for (int k=0;k<NUM_CHILDREN;k++)
+        {
+            int child=nodes[p].m_children[k];
+            if (child==NONE)
+                continue;
+            if (last)
+            {
+                if (child<0 || child>=static_cast<int>(leaves.size()))
+                    return false;
+            }
+            else
+            {
+                if (child<=p || child>=count || level[child]>=0)
+                    return false;
+                level[child]=level[p]+1;
+            }
+        }
+    }
+    for (size_t leaf=0;leaf<leaves.size();leaf++)
+    {
+        if (!validValueChain(leaves[leaf].m_firstValue, leaves[leaf].m_lastValue, values.size()))
+            return false;
+    }
+    return true;
+}
+
+//The key lengths KmerTrie is instantiated for, in one place: calls f(std::integral_constant<int, depth>())
+//so f can name a KmerTrie of that Depth, or returns false without calling it for any other length, which
+//needs a Trie.
+template<typename Function>
+bool withKmerTrieDepth(int depth, Function f)
+{
+    switch (depth)
+    {
+        case 8:  f(std::integral_constant<int, 8>()); return true;
+        case 10: f(std::integral_constant<int, 10>()); return true;
+        case 12: f(std::integral_constant<int, 12>()); return true;
+        case 14: f(std::integral_constant<int, 14>()); return true;
+        case 16: f(std::integral_constant<int, 16>()); return true;
+        case 20: f(std::integral_constant<int, 20>()); return true;
+        case 24: f(std::integral_constant<int, 24>()); return true;
+        case 32: f(std::integral_constant<int, 32>()); return true;
+        default: return false;
+    }
+}
 
 #endif // TRIE_INCLUDED
 
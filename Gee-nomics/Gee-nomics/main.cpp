@@ -71,6 +71,7 @@ int main()
 
 */
 
+#if 0
 #include <iostream>
 #include <fstream> // needed to open files
 #include <string>
@@ -116,14 +117,11 @@ int main()
  
  
 }
-
-
-
-
-
-/*
+#endif
 
 #include "provided.h"
+#include "QueryServer.h"
+#include "QueryPipeline.h"
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -131,6 +129,7 @@ int main()
 #include <vector>
 #include <cctype>
 #include <cstdlib>
+#include <csignal>
 using namespace std;
 
 // Change the string literal in this declaration to be the path to the
@@ -224,23 +223,101 @@ void loadOneDataFile(GenomeMatcher* library)
     vector<Genome> genomes;
     if (!loadFile(filename, genomes))
         return;
-    for (const auto& g : genomes)
-        library->addGenome(g);
+    library->addGenomes(genomes);
     cout << "Successfully loaded " << genomes.size() << " genomes." << endl;
 }
 
 void loadProvidedFiles(GenomeMatcher* library)
 {
+    //parse and index all the files at once
+    vector<string> filenames;
     for (const string& f : providedFiles)
+        filenames.push_back(PROVIDED_DIR + "/" + f);
+    vector<int> genomesLoaded;
+    library->addGenomesFromFiles(filenames, genomesLoaded);
+    for (size_t k = 0; k < filenames.size(); k++)
     {
-        vector<Genome> genomes;
-        if (loadFile(PROVIDED_DIR + "/" + f, genomes))
-        {
-            for (const auto& g : genomes)
-                library->addGenome(g);
-            cout << "Loaded " << genomes.size() << " genomes from " << f << endl;
-        }
+        if (genomesLoaded[k] < 0)
+            cout << "Cannot load file: " << filenames[k] << endl;
+        else
+            cout << "Loaded " << genomesLoaded[k] << " genomes from " << providedFiles[k] << endl;
+    }
+}
+
+void removeGenome(GenomeMatcher* library)
+{
+    cout << "Enter name of the genome to remove: ";
+    string name;
+    getline(cin, name);
+    if (name.empty())
+    {
+        cout << "Name must not be empty." << endl;
+        return;
+    }
+    if (!library->removeGenome(name))
+    {
+        cout << "No genome named " << name << " in the library." << endl;
+        return;
+    }
+    cout << "Removed " << name << endl;
+}
+
+void replaceFromDataFile(GenomeMatcher* library)
+{
+    string filename;
+    cout << "Enter file name of the new versions: ";
+    getline(cin, filename);
+    if (filename.empty())
+    {
+        cout << "No file name entered." << endl;
+        return;
+    }
+    vector<Genome> genomes;
+    if (!loadFile(filename, genomes))
+        return;
+    int replaced = 0;
+    for (const auto& g : genomes)
+    {
+        if (library->replaceGenome(g))
+            replaced++;
+    }
+    cout << "Replaced " << replaced << " genomes and added " << genomes.size() - replaced << " new ones." << endl;
+}
+
+void saveLibrary(GenomeMatcher* library)
+{
+    string filename;
+    cout << "Enter file name to write the library to: ";
+    getline(cin, filename);
+    if (filename.empty())
+    {
+        cout << "No file name entered." << endl;
+        return;
+    }
+    if (!library->save(filename))
+    {
+        cout << "Cannot write file: " << filename << endl;
+        return;
+    }
+    cout << "Library written to " << filename << endl;
+}
+
+void openLibrary(GenomeMatcher* library)
+{
+    string filename;
+    cout << "Enter name of a library file written by w: ";
+    getline(cin, filename);
+    if (filename.empty())
+    {
+        cout << "No file name entered." << endl;
+        return;
+    }
+    if (!library->load(filename))
+    {
+        cout << "Not a valid library file: " << filename << endl;
+        return;
     }
+    cout << "Opened " << filename << ", minSearchLength is " << library->minimumSearchLength() << endl;
 }
 
 void findGenome(GenomeMatcher* library, bool exactMatch)
@@ -339,6 +416,7 @@ void findRelatedGenomesManual(GenomeMatcher* library)
         cout << " " << setw(6) << m.percentMatch << "%  " << m.genomeName << endl;
 }
 
+// Reads FASTA or FASTQ (see QueryPipeline.h); build with QueryPipeline.cpp
 void findRelatedGenomesFromFile(GenomeMatcher* library)
 {
     string filename;
@@ -349,31 +427,92 @@ void findRelatedGenomesFromFile(GenomeMatcher* library)
         cout << "No file name entered." << endl;
         return;
     }
-    vector<Genome> genomes;
-    if (!loadFile(filename, genomes))
+    ifstream inputf(filename);
+    if (!inputf)
+    {
+        cout << "Cannot open file: " << filename << endl;
         return;
+    }
     double pctThreshold;
     bool exactMatchOnly;
     if (!getFindRelatedParams(pctThreshold, exactMatchOnly))
         return;
-    
-    int minLength = library->minimumSearchLength();
-    for (const auto& g : genomes)
+
+    // The file is read, matched and printed a chunk at a time, so read sets of any size fit in memory
+    QueryStreamOptions options;
+    options.fragmentMatchLength = 2 * library->minimumSearchLength();
+    options.exactMatchOnly = exactMatchOnly;
+    options.matchPercentThreshold = pctThreshold;
+    cout.setf(ios::fixed);
+    cout.precision(2);
+    string error;
+    bool ok = streamRelatedGenomes(*library, inputf, options, [](const Genome& g, const vector<GenomeMatch>& matches)
     {
-        vector<GenomeMatch> matches;
-        library->findRelatedGenomes(g, 2 * minLength, exactMatchOnly, pctThreshold, matches);
         cout << "  For " << g.name() << endl;
         if (matches.empty())
         {
             cout << "    No related genomes were found" << endl;
-            continue;
+            return;
         }
         cout << "    " << matches.size() << " related genomes were found:" << endl;
-        cout.setf(ios::fixed);
-        cout.precision(2);
         for (const auto& m : matches)
             cout << "     " << setw(6) << m.percentMatch << "%  " << m.genomeName << endl;
+    }, error);
+    if (!ok)
+        cout << "Improperly formatted file: " << filename << " (" << error << ")" << endl;
+}
+
+void showHistogram(const string& title, const StatHistogram& h)
+{
+    cout << "  " << title << ": " << h.samples << " samples";
+    if (h.samples > 0)
+        cout << ", mean " << fixed << setprecision(1) << static_cast<double>(h.total) / h.samples;
+    cout << endl;
+    for (size_t b = 0; b < h.buckets.size(); b++)
+    {
+        if (h.buckets[b] == 0)
+            continue;
+        long long low = (b == 0) ? 0 : 1LL << (b - 1);
+        long long high = (b == 0) ? 0 : (1LL << b) - 1;
+        cout << "    " << setw(12) << low << " - " << setw(12) << high << "  " << h.buckets[b] << endl;
+    }
+}
+
+void dumpStatistics()
+{
+    MatcherStatistics stats;
+    GenomeMatcher::statistics(stats);
+    if (!stats.enabled)
+    {
+        cout << "Statistics are off; rebuild with -DGEENOMICS_STATS to collect them." << endl;
+        return;
     }
+    cout << "Search statistics since the last dump:" << endl;
+    cout << "  fragments searched (per shard)  " << stats.fragments << endl;
+    cout << "  seed lookups                    " << stats.seedLookups << endl;
+    cout << "  trie nodes visited              " << stats.trieNodesVisited << endl;
+    cout << "  candidates                      " << stats.candidates << endl;
+    cout << "  candidates rejected             " << stats.candidatesRejected << endl;
+    cout << "  buffer capacity (bytes)         " << stats.bufferBytes << endl;
+    showHistogram("candidates per seed lookup", stats.candidatesPerSeed);
+    showHistogram("extension length (bases)", stats.extensionLength);
+    showHistogram("lookup (ns)", stats.lookupNanos);
+    showHistogram("extension (ns)", stats.extensionNanos);
+    showHistogram("aggregation (ns)", stats.aggregationNanos);
+    GenomeMatcher::resetStatistics();
+}
+
+void showMemoryUsage(const GenomeMatcher* library)
+{
+    MemoryUsage usage;
+    library->memoryUsage(usage);
+    cout << "Memory held by the library (bytes):" << endl;
+    cout << "  genomes                         " << usage.genomes << endl;
+    cout << "  index                           " << usage.index << endl;
+    cout << "  postings                        " << usage.postings << endl;
+    cout << "  scratch                         " << usage.scratch << endl;
+    cout << "  total                           " << usage.total() << endl;
+    cout << "  mapped from files               " << usage.mapped << endl;
 }
 
 void showMenu()
@@ -384,10 +523,134 @@ void showMenu()
     cout << "         l - load one data file             f - find related genomes (file)" << endl;
     cout << "         d - load all provided data files   ? - show this menu" << endl;
     cout << "         e - find matches exactly           q - quit" << endl;
+    cout << "         w - write library to a file        o - open a saved library" << endl;
+    cout << "         x - remove a genome                u - replace genomes from a data file" << endl;
+    cout << "         i - dump search statistics         m - show memory use" << endl;
 }
 
-int main()
+// Server mode: build or open a library once and answer queries from other processes on a socket
+// (see QueryServer.h). QueryClient.cpp is a client and load generator. Build with the server sources:
+//
+//     g++ -std=c++17 -O2 main.cpp Genome.cpp GenomeMatcher.cpp QueryServer.cpp QueryPipeline.cpp -pthread
+
+QueryServer* runningServer = nullptr;
+
+void stopServer(int)
+{
+    if (runningServer != nullptr)
+        runningServer->stop();
+}
+
+void serverUsage()
 {
+    cerr << "usage: geenomics --listen unix:PATH|[HOST:]PORT" << endl
+         << "                 (--library FILE | --data FILE... [--k N] [--engine trie|sa|kmer])" << endl
+         << "                 [--threads N] [--query-threads N] [--memory-budget BYTES] [--spill-dir DIR]" << endl;
+}
+
+int runServer(int argc, char* argv[])
+{
+    string address, libraryFile, engineName = "trie", spillDirectory;
+    vector<string> dataFiles;
+    int minSearchLength = 10, threads = 0, queryThreads = 1;
+    long long memoryBudget = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--data")
+        {
+            //every argument up to the next option is a data file
+            while (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0)
+                dataFiles.push_back(argv[++i]);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            serverUsage();
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--listen")
+            address = value;
+        else if (arg == "--library")
+            libraryFile = value;
+        else if (arg == "--k")
+            minSearchLength = atoi(value.c_str());
+        else if (arg == "--engine")
+            engineName = value;
+        else if (arg == "--threads")
+            threads = atoi(value.c_str());
+        else if (arg == "--query-threads")
+            queryThreads = atoi(value.c_str());
+        else if (arg == "--memory-budget")
+            memoryBudget = atoll(value.c_str());
+        else if (arg == "--spill-dir")
+            spillDirectory = value;
+        else
+        {
+            serverUsage();
+            return 1;
+        }
+    }
+    GenomeMatcherOptions options;
+    if (engineName == "sa")
+        options.engine = IndexEngine::SuffixArray;
+    else if (engineName == "kmer")
+        options.engine = IndexEngine::KmerHash;
+    else if (engineName != "trie")
+    {
+        serverUsage();
+        return 1;
+    }
+    options.queryThreads = queryThreads;
+    options.memoryBudget = memoryBudget;
+    options.spillDirectory = spillDirectory;
+    if (address.empty() || libraryFile.empty() == dataFiles.empty() || minSearchLength < 1)
+    {
+        serverUsage();
+        return 1;
+    }
+    GenomeMatcher library(minSearchLength, options);
+    if (!libraryFile.empty())
+    {
+        if (!library.load(libraryFile))
+        {
+            cerr << "Not a valid library file: " << libraryFile << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        vector<int> genomesLoaded;
+        library.addGenomesFromFiles(dataFiles, genomesLoaded);
+        for (size_t k = 0; k < dataFiles.size(); k++)
+        {
+            if (genomesLoaded[k] < 0)
+                cerr << "Cannot load file: " << dataFiles[k] << endl;
+        }
+    }
+    QueryServer server(library, threads);
+    string error;
+    if (!server.listen(address, error))
+    {
+        cerr << "Cannot listen on " << address << ": " << error << endl;
+        return 1;
+    }
+    runningServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    cerr << "Serving " << library.genomeCount() << " genomes (minSearchLength " << library.minimumSearchLength()
+         << ") on " << address << endl;
+    server.run();
+    runningServer = nullptr;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        return runServer(argc, argv);
+
     const int defaultMinSearchLength = 10;
     
     cout << "Welcome to the Gee-nomics test harness!" << endl;
@@ -439,7 +702,24 @@ int main()
             case 'f':
                 findRelatedGenomesFromFile(library);
                 break;
+            case 'w':
+                saveLibrary(library);
+                break;
+            case 'o':
+                openLibrary(library);
+                break;
+            case 'x':
+                removeGenome(library);
+                break;
+            case 'u':
+                replaceFromDataFile(library);
+                break;
+            case 'i':
+                dumpStatistics();
+                break;
+            case 'm':
+                showMemoryUsage(library);
+                break;
         }
     }
 }
-*/
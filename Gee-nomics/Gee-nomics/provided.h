@@ -6,11 +6,13 @@
 #include <istream>
 
 class GenomeImpl;
+class PackedSequence;
 
 class Genome
 {
 public:
     Genome(const std::string& nm, const std::string& sequence);
+    Genome(const std::string& nm, const PackedSequence& sequence);
     ~Genome();
     Genome(const Genome& other);
     Genome& operator=(const Genome& rhs);
@@ -18,6 +20,8 @@ public:
     int length() const;
     std::string name() const;
     bool extract(int position, int length, std::string& fragment) const;
+    //the 2-bit packed bases behind extract(), see PackedSequence.h
+    const PackedSequence& sequence() const;
     
 private:
     GenomeImpl* m_impl;
@@ -36,17 +40,168 @@ struct GenomeMatch
     double percentMatch;
 };
 
+//the same results naming the genome by its id in the GenomeMatcher (see genomeName())
+struct DNAMatchId
+{
+    int genomeId;
+    int length;
+    int position;
+};
+
+struct GenomeMatchId
+{
+    int genomeId;
+    double percentMatch;
+};
+
+//which index a GenomeMatcher builds over its library
+enum class IndexEngine
+{
+    Trie,           //every minSearchLength-long prefix in a Trie, each hit then extended base by base
+    SuffixArray,    //one suffix array over the whole library, matches any fragment length directly
+    KmerHash        //every minSearchLength-mer packed into 64 bits in flat sorted arrays (falls back to Trie past 32)
+};
+
+struct GenomeMatcherOptions
+{
+    IndexEngine engine = IndexEngine::Trie;
+    //threads findRelatedGenomes splits the query's fragments across; 1 scores them serially on the
+    //calling thread, 0 uses every hardware thread. Results are the same either way.
+    int queryThreads = 1;
+    //threads addGenomes and addGenomesFromFiles parse and build index shards on, 0 for every hardware thread
+    int buildThreads = 0;
+    //Trie and KmerHash only: above 1, index just one seed of minSearchLength-minimizerWindow+1 bases out of
+    //every minimizerWindow positions (their minimizers). Every match of minSearchLength or more bases is
+    //still found; the index is several times smaller, and searches allowing a SNiP do more lookups.
+    int minimizerWindow = 1;
+    //removeGenome and replaceGenome rebuild a shard in the background once removed genomes hold this
+    //fraction of its bases (above 1, only compact() does)
+    double compactionThreshold = 0.2;
+    //KmerHash only: about the most bytes the shards being built at once may gather their k-mers in, 0 for no
+    //limit. A shard past its share sorts what it has into a run on disk and goes on; the runs are then merged
+    //into a table kept in a file and mapped (see MemoryUsage), so an index too big for memory can still be
+    //built, at the cost of writing it out. The files are made in spillDirectory ("" for $TMPDIR or /tmp)
+    //and deleted as they are made, so nothing is left behind.
+    long long memoryBudget = 0;
+    std::string spillDirectory;
+};
+
+//What the library holds, in bytes, by part. Arrays that are views into a mapped file (a library opened with
+//load(), or a k-mer table built past the memory budget) count under mapped instead of their part: the
+//kernel can drop their pages and read them back whenever it likes, so they don't need memory of their own.
+struct MemoryUsage
+{
+    long long genomes = 0;      //names and packed bases
+    long long index = 0;        //trie nodes, k-mer tables and suffix arrays, and where each shard's genomes lie
+    long long postings = 0;     //the compressed lists of where each seed occurs
+    long long scratch = 0;      //what a shard has gathered but not yet built into its index
+    long long mapped = 0;
+    //every part but mapped
+    long long total() const
+    {
+        return genomes+index+postings+scratch;
+    }
+};
+
+//how much of the work findRelatedGenomes may skip
+struct RelatedGenomesOptions
+{
+    //keep only the best topK genomes, 0 keeps every one that clears the threshold
+    int topK = 0;
+    //stop scoring a genome once it can't reach matchPercentThreshold (or the top k) even if every
+    //remaining fragment matched it; the results are the same, found sooner
+    bool pruneHopeless = false;
+    //stop scoring a genome as soon as it clears matchPercentThreshold; its percentMatch is then only a
+    //lower bound, so the order among the results is approximate
+    bool stopAtThreshold = false;
+    //a fragment starts every stride bases; 0 (or fragmentMatchLength) tiles the query with fragments that
+    //don't overlap. A smaller stride scores overlapping windows of fragmentMatchLength bases instead, which
+    //also finds matches straddling two tiles, and percentMatch is then the share of the windows matched.
+    int stride = 0;
+};
+
+//a log2 histogram: buckets[0] counts zeros, buckets[b] the values from 2^(b-1) to 2^b-1
+struct StatHistogram
+{
+    std::vector<long long> buckets;
+    long long samples = 0;
+    long long total = 0;    //the sum of the values
+};
+
+//Counters and timers from the search hot paths, added up over every GenomeMatcher in the process since the
+//last resetStatistics(). They are only kept in a build with GEENOMICS_STATS defined; otherwise the hooks
+//compile to nothing, enabled is false and everything stays zero.
+struct MatcherStatistics
+{
+    bool enabled = false;
+    long long fragments = 0;            //fragments searched, once per shard
+    long long seedLookups = 0;
+    long long trieNodesVisited = 0;
+    long long candidates = 0;           //places the seed lookups found
+    long long candidatesRejected = 0;   //of those, the ones the first-base check or the extension ruled out
+    long long bufferBytes = 0;          //capacity the candidate and hit buffers of the searches grew to, not a
+                                        //count of allocations: a buffer reused across a batch counts once
+    StatHistogram candidatesPerSeed;
+    StatHistogram extensionLength;      //bases, for every candidate extended
+    //nanoseconds per fragment and shard: finding the candidates, extending them, then (once per fragment)
+    //keeping the best match per genome
+    StatHistogram lookupNanos;
+    StatHistogram extensionNanos;
+    StatHistogram aggregationNanos;
+};
+
 class GenomeMatcherImpl;
 
+//Any number of threads may search a GenomeMatcher while another changes it. Every change (adding, removing,
+//replacing, compacting, loading) is made to a new version of the library that searches only see once it is
+//complete, so a search never waits on a change and sees the library as it was before or after it, never in
+//between. Changes are made one at a time.
 class GenomeMatcher
 {
 public:
-    GenomeMatcher(int minSearchLength);
+    GenomeMatcher(int minSearchLength, const GenomeMatcherOptions& options = GenomeMatcherOptions());
     ~GenomeMatcher();
     void addGenome(const Genome& genome);
+    //add a batch of genomes, building the index for them in parallel shards
+    void addGenomes(const std::vector<Genome>& genomes);
+    //parse the files concurrently and add the genomes of every file that loads, in file order;
+    //genomesLoaded[k] is how many came from filenames[k], or -1 if it couldn't be opened or parsed
+    void addGenomesFromFiles(const std::vector<std::string>& filenames, std::vector<int>& genomesLoaded);
+    //Drop every genome with this name from the searches at once, false if there is none. The index keeps
+    //it until a background compaction rebuilds its shard; searches carry on while that runs, and
+    //changes to the library wait for it.
+    bool removeGenome(const std::string& name);
+    //swap the genomes with genome's name for genome in one step (adding it if there were none);
+    //true if any were replaced
+    bool replaceGenome(const Genome& genome);
+    //rebuild every shard that still holds removed genomes now, rather than waiting for the threshold
+    void compact();
     int minimumSearchLength() const;
+    //every distinct genome name has an id from 0 to genomeCount()-1, in the order it was first added;
+    //the name genomeName() returns stays good until the next load()
+    int genomeCount() const;
+    const std::string& genomeName(int genomeId) const;
     bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const;
-    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results) const;
+    //the same searches reporting genome ids, which skips building a name string for every result
+    bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatchId>& matches) const;
+    //search many fragments in one call: matches is resized to fit and matches[k] holds what the call above
+    //would find for fragments[k] (empty if nothing). Returns false if minimumLength is below
+    //minimumSearchLength(), otherwise whether any fragment matched.
+    bool findGenomesWithThisDNA(const std::vector<std::string>& fragments, int minimumLength, bool exactMatchOnly, std::vector<std::vector<DNAMatch>>& matches) const;
+    //with pruning in options the return value says whether any genome made it into results
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results, const RelatedGenomesOptions& options = RelatedGenomesOptions()) const;
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatchId>& results, const RelatedGenomesOptions& options = RelatedGenomesOptions()) const;
+    //write the library (genomes and index) to a versioned binary file, false if it can't be written
+    bool save(const std::string& filename) const;
+    //replace the library with one written by save(), taking its minSearchLength, engine and minimizer window. The file is
+    //memory-mapped rather than read, so this returns almost at once and processes share its pages.
+    //Returns false, leaving the library as it was, if the file is missing or not a valid index.
+    bool load(const std::string& filename);
+    //the memory the library holds now (see MemoryUsage)
+    void memoryUsage(MemoryUsage& usage) const;
+    //the search statistics so far (see MatcherStatistics), and starting them over
+    static void statistics(MatcherStatistics& stats);
+    static void resetStatistics();
     // We prevent a GenomeMatcher object from being copied or assigned.
     GenomeMatcher(const GenomeMatcher&) = delete;
     GenomeMatcher& operator=(const GenomeMatcher&) = delete;